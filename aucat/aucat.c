@@ -432,8 +432,10 @@ slot_del(struct slot *s)
 		logx(3, "%s: closed", s->afile.path);
 #endif
 		abuf_done(&s->buf);
-		if (s->resampbuf)
+		if (s->resampbuf) {
+			resamp_done(&s->resamp);
 			xfree(s->resampbuf);
+		}
 		if (s->convbuf)
 			xfree(s->convbuf);
 	}
@@ -1426,6 +1428,7 @@ main(int argc, char **argv)
 		logx(1, "%s", usagestr);
 		return 1;
 	}
+	dsp_init();
 	if (n_flag) {
 		if (dev != NULL || port != NULL) {
 			logx(1, "-f and -q make no sense in off-line mode");
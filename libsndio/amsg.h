@@ -87,7 +87,7 @@ struct amsg {
 			uint8_t msb;		/* 1 if MSB justified */
 			uint8_t le;		/* 1 if little endian */
 			uint8_t sig;		/* 1 if signed */
-			uint8_t __pad1;
+			uint8_t flt;		/* 1 if floating point */
 			uint16_t pchan;		/* play channels */
 			uint16_t rchan;		/* record channels */
 			uint32_t rate;		/* frames per second */
@@ -97,9 +97,12 @@ struct amsg {
 			uint32_t _reserved[1];	/* for future use */
 		} par;
 		struct amsg_data {
-#define AMSG_DATAMAX	0x1000
+#define AMSG_DATAMAX	0x1000		/* max size with version 7 peers */
 			uint32_t size;
 		} data;
+		struct amsg_ack {
+			uint32_t datamax;	/* since version 8 */
+		} ack;
 		struct amsg_start {
 			uint8_t xrunnotify;
 		} start;
@@ -114,7 +117,8 @@ struct amsg {
 		} vol;
 		struct amsg_hello {
 			uint16_t mode;		/* bitmap of MODE_XXX */
-#define AMSG_VERSION	7
+#define AMSG_VERSION	8
+#define AMSG_VERSION_MIN 7
 			uint8_t version;	/* protocol version */
 #define AMSG_NODEV	255
 			uint8_t devnum;		/* device number */
@@ -18,6 +18,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 
 #include <netinet/in.h>
@@ -154,6 +155,44 @@ _aucat_rdata(struct aucat *hdl, void *buf, size_t len, int *eof)
 	return n;
 }
 
+/*
+ * write the data message header together with the beginning of the
+ * data, return the number of data bytes written
+ */
+static size_t
+_aucat_wmsgdata(struct aucat *hdl, const void *buf, size_t len, int *eof)
+{
+	struct iovec iov[2];
+	ssize_t n;
+	size_t datasize;
+
+	datasize = ntohl(hdl->wmsg.u.data.size);
+	if (len > datasize)
+		len = datasize;
+	iov[0].iov_base = (unsigned char *)&hdl->wmsg +
+	    sizeof(struct amsg) - hdl->wtodo;
+	iov[0].iov_len = hdl->wtodo;
+	iov[1].iov_base = (void *)buf;
+	iov[1].iov_len = len;
+	while ((n = writev(hdl->fd, iov, 2)) == -1) {
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN) {
+			*eof = 1;
+			DPERROR("_aucat_wmsgdata: writev");
+		}
+		return 0;
+	}
+	if (n < hdl->wtodo) {
+		hdl->wtodo -= n;
+		return 0;
+	}
+	n -= hdl->wtodo;
+	hdl->wtodo = datasize;
+	hdl->wstate = WSTATE_DATA;
+	return n;
+}
+
 size_t
 _aucat_wdata(struct aucat *hdl, const void *buf, size_t len,
    unsigned int wbpf, int *eof)
@@ -164,8 +203,8 @@ _aucat_wdata(struct aucat *hdl, const void *buf, size_t len,
 	switch (hdl->wstate) {
 	case WSTATE_IDLE:
 		datasize = len;
-		if (datasize > AMSG_DATAMAX)
-			datasize = AMSG_DATAMAX;
+		if (datasize > hdl->datamax)
+			datasize = hdl->datamax;
 		datasize -= datasize % wbpf;
 		if (datasize == 0)
 			datasize = wbpf;
@@ -175,23 +214,34 @@ _aucat_wdata(struct aucat *hdl, const void *buf, size_t len,
 		hdl->wstate = WSTATE_MSG;
 		/* FALLTHROUGH */
 	case WSTATE_MSG:
-		if (!_aucat_wmsg(hdl, eof))
+		if (ntohl(hdl->wmsg.cmd) != AMSG_DATA) {
+			/*
+			 * finish the pending control message, data will
+			 * be sent in its own message
+			 */
+			_aucat_wmsg(hdl, eof);
+			return 0;
+		}
+		n = _aucat_wmsgdata(hdl, buf, len, eof);
+		if (n == 0)
+			return 0;
+		break;
+	default:
+		if (len > hdl->wtodo)
+			len = hdl->wtodo;
+		if (len == 0) {
+			DPRINTF("_aucat_wdata: len == 0\n");
+			abort();
+		}
+		while ((n = write(hdl->fd, buf, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN) {
+				*eof = 1;
+				DPERROR("_aucat_wdata: write");
+			}
 			return 0;
-	}
-	if (len > hdl->wtodo)
-		len = hdl->wtodo;
-	if (len == 0) {
-		DPRINTF("_aucat_wdata: len == 0\n");
-		abort();
-	}
-	while ((n = write(hdl->fd, buf, len)) == -1) {
-		if (errno == EINTR)
-			continue;
-		if (errno != EAGAIN) {
-			*eof = 1;
-			DPERROR("_aucat_wdata: write");
 		}
-		return 0;
 	}
 	DPRINTFN(2, "_aucat_wdata: write: n = %zd\n", n);
 	hdl->wtodo -= n;
@@ -411,7 +461,7 @@ _aucat_open(struct aucat *hdl, const char *str, unsigned int mode)
 	int eof;
 	char host[NI_MAXHOST], opt[AMSG_OPTMAX];
 	const char *p;
-	unsigned int unit, devnum, type;
+	unsigned int unit, devnum, type, datamax;
 
 	if ((p = _sndio_parsetype(str, "snd")) != NULL)
 		type = AMSG_TYPE_SND;
@@ -515,6 +565,15 @@ _aucat_open(struct aucat *hdl, const char *str, unsigned int mode)
 		DPRINTF("aucat_init: protocol err\n");
 		goto bad_connect;
 	}
+
+	/*
+	 * the server may accept DATA messages larger than AMSG_DATAMAX,
+	 * typically a full block
+	 */
+	datamax = ntohl(hdl->rmsg.u.ack.datamax);
+	hdl->datamax = (AMSG_ISSET(datamax) && datamax > AMSG_DATAMAX) ?
+	    datamax : AMSG_DATAMAX;
+	DPRINTFN(2, "_aucat_open: datamax = %u\n", hdl->datamax);
 	return 1;
  bad_connect:
 	while (close(hdl->fd) == -1 && errno == EINTR)
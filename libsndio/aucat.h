@@ -32,6 +32,7 @@ struct aucat {
 #define WSTATE_DATA	4		/* data being transferred */
 	unsigned wstate;		/* one of above */
 	unsigned maxwrite;		/* bytes we're allowed to write */
+	unsigned datamax;		/* max size of DATA messages */
 };
 
 int _aucat_rmsg(struct aucat *, int *);
@@ -116,8 +116,9 @@ static snd_pcm_format_t cap_fmts[] = {
  */
 static int
 sio_alsa_fmttopar(struct sio_alsa_hdl *hdl, snd_pcm_format_t fmt,
-    unsigned int *bits, unsigned int *sig, unsigned int *le)
+    unsigned int *bits, unsigned int *sig, unsigned int *le, unsigned int *flt)
 {
+	*flt = 0;
 	switch (fmt) {
 	case SND_PCM_FORMAT_U8:
 		*bits = 8;
@@ -187,6 +188,18 @@ sio_alsa_fmttopar(struct sio_alsa_hdl *hdl, snd_pcm_format_t fmt,
 		*sig = 0;
 		*le = 0;
 		break;
+	case SND_PCM_FORMAT_FLOAT_LE:
+		*bits = 32;
+		*sig = 1;
+		*le = 1;
+		*flt = 1;
+		break;
+	case SND_PCM_FORMAT_FLOAT_BE:
+		*bits = 32;
+		*sig = 1;
+		*le = 0;
+		*flt = 1;
+		break;
 	default:
 		DPRINTF("sio_alsa_fmttopar: 0x%x: unsupported format\n", fmt);
 		hdl->sio.eof = 1;
@@ -201,9 +214,18 @@ sio_alsa_fmttopar(struct sio_alsa_hdl *hdl, snd_pcm_format_t fmt,
  */
 static void
 sio_alsa_enctofmt(struct sio_alsa_hdl *hdl, snd_pcm_format_t *rfmt,
-    unsigned int bits, unsigned int sig, unsigned int le)
+    unsigned int bits, unsigned int sig, unsigned int le, unsigned int flt)
 {
-	if (bits == 8) {
+	if (flt == 1) {
+		if (le == ~0U) {
+			*rfmt = SIO_LE_NATIVE ?
+			    SND_PCM_FORMAT_FLOAT_LE :
+			    SND_PCM_FORMAT_FLOAT_BE;
+		} else if (le)
+			*rfmt = SND_PCM_FORMAT_FLOAT_LE;
+		else
+			*rfmt = SND_PCM_FORMAT_FLOAT_BE;
+	} else if (bits == 8) {
 		if (sig == ~0U || !sig)
 			*rfmt = SND_PCM_FORMAT_U8;
 		else
@@ -669,6 +691,7 @@ sio_alsa_getcap(struct sio_hdl *sh, struct sio_cap *cap)
 {
 	struct sio_alsa_hdl *hdl = (struct sio_alsa_hdl *)sh;
 	int irates, orates, ifmts, ofmts, ichans, ochans;
+	unsigned int flt;
 	int i;
 
 	irates = orates = ifmts = ofmts = ichans = ochans = 0;
@@ -690,7 +713,8 @@ sio_alsa_getcap(struct sio_hdl *sh, struct sio_cap *cap)
 		sio_alsa_fmttopar(hdl, cap_fmts[i],
 		    &cap->enc[i].bits,
 		    &cap->enc[i].sig,
-		    &cap->enc[i].le);
+		    &cap->enc[i].le,
+		    &flt);
 		cap->enc[i].bps = SIO_BPS(cap->enc[0].bits);
 		cap->enc[i].msb = 1;
 	}
@@ -738,7 +762,7 @@ sio_alsa_setpar(struct sio_hdl *sh, struct sio_par *par)
 	snd_pcm_hw_params_alloca(&ihwp);
 	snd_pcm_sw_params_alloca(&iswp);
 
-	sio_alsa_enctofmt(hdl, &ifmt, par->bits, par->sig, par->le);
+	sio_alsa_enctofmt(hdl, &ifmt, par->bits, par->sig, par->le, par->flt);
 	irate = (par->rate == ~0U) ? 48000 : par->rate;
 	if (par->appbufsz != ~0U) {
 		iround = (par->round != ~0U) ?
@@ -804,7 +828,7 @@ sio_alsa_setpar(struct sio_hdl *sh, struct sio_par *par)
 		return 0;
 	}
 	if (!sio_alsa_fmttopar(hdl, ifmt,
-		&hdl->par.bits, &hdl->par.sig, &hdl->par.le))
+		&hdl->par.bits, &hdl->par.sig, &hdl->par.le, &hdl->par.flt))
 		return 0;
 	hdl->par.msb = 1;
 	hdl->par.bps = SIO_BPS(hdl->par.bits);
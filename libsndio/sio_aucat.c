@@ -289,8 +289,10 @@ sio_aucat_setpar(struct sio_hdl *sh, struct sio_par *par)
 	hdl->aucat.wmsg.u.par.sig = par->sig;
 	hdl->aucat.wmsg.u.par.le = par->le;
 	hdl->aucat.wmsg.u.par.msb = par->msb;
+	hdl->aucat.wmsg.u.par.flt = par->flt;
 	hdl->aucat.wmsg.u.par.rate = htonl(par->rate);
 	hdl->aucat.wmsg.u.par.appbufsz = htonl(par->appbufsz);
+	hdl->aucat.wmsg.u.par.round = htonl(par->round);
 	hdl->aucat.wmsg.u.par.xrun = par->xrun;
 	if (hdl->sio.mode & SIO_REC)
 		hdl->aucat.wmsg.u.par.rchan = htons(par->rchan);
@@ -325,6 +327,7 @@ sio_aucat_getpar(struct sio_hdl *sh, struct sio_par *par)
 	par->sig = hdl->aucat.rmsg.u.par.sig;
 	par->le = hdl->aucat.rmsg.u.par.le;
 	par->msb = hdl->aucat.rmsg.u.par.msb;
+	par->flt = hdl->aucat.rmsg.u.par.flt == 1;
 	par->rate = ntohl(hdl->aucat.rmsg.u.par.rate);
 	par->bufsz = ntohl(hdl->aucat.rmsg.u.par.bufsz);
 	par->appbufsz = ntohl(hdl->aucat.rmsg.u.par.appbufsz);
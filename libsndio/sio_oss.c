@@ -543,6 +543,7 @@ sio_oss_getpar(struct sio_hdl *sh, struct sio_par *par)
 			par->bits = formats[i].bits;
 			par->bps = formats[i].bps;
 			par->msb = formats[i].msb;
+			par->flt = 0;
 			found = 1;
 			break;
 		}
@@ -461,6 +461,7 @@ sio_sun_getpar(struct sio_hdl *sh, struct sio_par *par)
 	par->bits = ap.bits;
 	par->bps = ap.bps;
 	par->msb = ap.msb;
+	par->flt = 0;
 	par->rate = ap.rate;
 	par->pchan = ap.pchan;
 	par->rchan = ap.rchan;
@@ -57,7 +57,8 @@ struct sio_par {
 	unsigned int xrun;	/* what to do on overruns/underruns */
 	unsigned int round;	/* optimal bufsz divisor */
 	unsigned int appbufsz;	/* minimum buffer size */
-	int __pad[3];		/* for future use */
+	unsigned int flt;	/* 1 = IEEE 754 floating point */
+	int __pad[2];		/* for future use */
 	unsigned int __magic;	/* for internal/debug purposes only */
 };
 
@@ -19,9 +19,19 @@
  *
  * The abuf data is split in two parts: (1) valid data available to the reader
  * (2) space available to the writer, which is not necessarily unused. It works
- * as follows: the write starts filling at offset (start + used), once the data
- * is ready, the writer adds to used the count of bytes available.
+ * as follows: the write starts filling at the writer position, once the data
+ * is ready, the writer advances its position by the count of bytes available.
+ *
+ * The reader and the writer each own their position, and only read the
+ * other's one, so they may run in different threads without locking.
+ * Positions are stored modulo twice the buffer size, so that a full
+ * buffer can be distinguished from an empty one. A position is
+ * published (release) only once the data it covers is written or
+ * consumed, and it's read (acquire) before the data is accessed.
  */
+#include <sys/types.h>
+#include <sys/uio.h>
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -29,39 +39,60 @@
 #include "abuf.h"
 #include "utils.h"
 
+#define ABUF_LOAD(p)		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define ABUF_STORE(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
 void
 abuf_init(struct abuf *buf, unsigned int len)
 {
-	buf->data = xmalloc(len);
+	buf->data = xbuf_get(len);
 	buf->len = len;
-	buf->used = 0;
-	buf->start = 0;
+	buf->rpos = 0;
+	buf->wpos = 0;
 }
 
 void
 abuf_done(struct abuf *buf)
 {
 #ifdef DEBUG
-	if (buf->used > 0)
-		logx(3, "deleting non-empty buffer, used = %d", buf->used);
+	if (abuf_used(buf) > 0)
+		logx(3, "deleting non-empty buffer, used = %d", abuf_used(buf));
 #endif
-	xfree(buf->data);
+	xbuf_put(buf->data);
 	buf->data = (void *)0xdeadbeef;
 }
 
+/*
+ * return the number of bytes stored in the buffer, may be called by
+ * the reader or by the writer
+ */
+int
+abuf_used(struct abuf *buf)
+{
+	unsigned int rpos, wpos;
+
+	rpos = ABUF_LOAD(&buf->rpos);
+	wpos = ABUF_LOAD(&buf->wpos);
+	return (wpos >= rpos) ? wpos - rpos : wpos + 2 * buf->len - rpos;
+}
+
 /*
  * return the reader pointer and the number of bytes available
  */
 unsigned char *
 abuf_rgetblk(struct abuf *buf, int *rsize)
 {
-	int count;
+	unsigned int start, used, count;
 
-	count = buf->len - buf->start;
-	if (count > buf->used)
-		count = buf->used;
+	used = abuf_used(buf);
+	start = buf->rpos;
+	if (start >= buf->len)
+		start -= buf->len;
+	count = buf->len - start;
+	if (count > used)
+		count = used;
 	*rsize = count;
-	return buf->data + buf->start;
+	return buf->data + start;
 }
 
 /*
@@ -70,16 +101,18 @@ abuf_rgetblk(struct abuf *buf, int *rsize)
 void
 abuf_rdiscard(struct abuf *buf, int count)
 {
+	unsigned int rpos;
+
 #ifdef DEBUG
-	if (count < 0 || count > buf->used) {
+	if (count < 0 || count > abuf_used(buf)) {
 		logx(0, "%s: bad count = %d", __func__, count);
 		panic();
 	}
 #endif
-	buf->used -= count;
-	buf->start += count;
-	if (buf->start >= buf->len)
-		buf->start -= buf->len;
+	rpos = buf->rpos + count;
+	if (rpos >= 2 * buf->len)
+		rpos -= 2 * buf->len;
+	ABUF_STORE(&buf->rpos, rpos);
 }
 
 /*
@@ -88,13 +121,18 @@ abuf_rdiscard(struct abuf *buf, int count)
 void
 abuf_wcommit(struct abuf *buf, int count)
 {
+	unsigned int wpos;
+
 #ifdef DEBUG
-	if (count < 0 || count > (buf->len - buf->used)) {
+	if (count < 0 || count > (buf->len - abuf_used(buf))) {
 		logx(0, "%s: bad count = %d", __func__, count);
 		panic();
 	}
 #endif
-	buf->used += count;
+	wpos = buf->wpos + count;
+	if (wpos >= 2 * buf->len)
+		wpos -= 2 * buf->len;
+	ABUF_STORE(&buf->wpos, wpos);
 }
 
 /*
@@ -103,15 +141,71 @@ abuf_wcommit(struct abuf *buf, int count)
 unsigned char *
 abuf_wgetblk(struct abuf *buf, int *rsize)
 {
-	int end, avail, count;
+	unsigned int end, avail, count;
 
-	end = buf->start + buf->used;
+	avail = buf->len - abuf_used(buf);
+	end = buf->wpos;
 	if (end >= buf->len)
 		end -= buf->len;
-	avail = buf->len - buf->used;
 	count = buf->len - end;
 	if (count > avail)
 		count = avail;
 	*rsize = count;
 	return buf->data + end;
 }
+
+/*
+ * describe the data available for reading as up to two blocks, the
+ * second one starting at the beginning of the buffer. Return the number
+ * of blocks.
+ */
+int
+abuf_rgetvec(struct abuf *buf, struct iovec *iov)
+{
+	unsigned int start, used, count;
+
+	used = abuf_used(buf);
+	if (used == 0)
+		return 0;
+	start = buf->rpos;
+	if (start >= buf->len)
+		start -= buf->len;
+	count = buf->len - start;
+	iov[0].iov_base = buf->data + start;
+	if (count >= used) {
+		iov[0].iov_len = used;
+		return 1;
+	}
+	iov[0].iov_len = count;
+	iov[1].iov_base = buf->data;
+	iov[1].iov_len = used - count;
+	return 2;
+}
+
+/*
+ * describe the space available for writing as up to two blocks, the
+ * second one starting at the beginning of the buffer. Return the number
+ * of blocks.
+ */
+int
+abuf_wgetvec(struct abuf *buf, struct iovec *iov)
+{
+	unsigned int end, avail, count;
+
+	avail = buf->len - abuf_used(buf);
+	if (avail == 0)
+		return 0;
+	end = buf->wpos;
+	if (end >= buf->len)
+		end -= buf->len;
+	count = buf->len - end;
+	iov[0].iov_base = buf->data + end;
+	if (count >= avail) {
+		iov[0].iov_len = avail;
+		return 1;
+	}
+	iov[0].iov_len = count;
+	iov[1].iov_base = buf->data;
+	iov[1].iov_len = avail - count;
+	return 2;
+}
@@ -17,17 +17,22 @@
 #ifndef ABUF_H
 #define ABUF_H
 
+struct iovec;
+
 struct abuf {
-	int start;	        /* offset (frames) where stored data starts */
-	int used;	        /* frames stored in the buffer */
-	unsigned int len;	/* total size of the buffer (frames) */
+	unsigned int rpos;	/* reader position, modulo 2 * len */
+	unsigned int wpos;	/* writer position, modulo 2 * len */
+	unsigned int len;	/* total size of the buffer (bytes) */
 	unsigned char *data;
 };
 
 void abuf_init(struct abuf *, unsigned int);
 void abuf_done(struct abuf *);
+int abuf_used(struct abuf *);
 unsigned char *abuf_rgetblk(struct abuf *, int *);
 unsigned char *abuf_wgetblk(struct abuf *, int *);
+int abuf_rgetvec(struct abuf *, struct iovec *);
+int abuf_wgetvec(struct abuf *, struct iovec *);
 void abuf_rdiscard(struct abuf *, int);
 void abuf_wcommit(struct abuf *, int);
 
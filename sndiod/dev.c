@@ -16,6 +16,7 @@
  */
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include "bsd-compat.h"
 
 #include "abuf.h"
@@ -27,6 +28,7 @@
 #include "opt.h"
 #include "sysex.h"
 #include "utils.h"
+#include "worker.h"
 
 void zomb_onmove(void *);
 void zomb_onxrun(void *);
@@ -36,15 +38,47 @@ void zomb_flush(void *);
 void zomb_eof(void *);
 void zomb_exit(void *);
 
-void dev_mix_badd(struct dev *, struct slot *);
-void dev_mix_adjvol(struct dev *);
-void dev_sub_bcopy(struct dev *, struct slot *);
+long long dev_nsec(void);
+void dev_addstats(struct dev *, long long);
+int dev_mix_bsil(struct slot *);
+struct slot *dev_mix_excl(struct dev *);
+void dev_mix_bcopy(struct dev *, struct slot *);
+void dev_mix_badd(struct dev *, struct slot *, adata_t (*)[DEV_TILESZ]);
+int dev_mixgrp_bskip(struct dev *, struct mixgrp *);
+void dev_mixgrp_badd(struct dev *, struct mixgrp *,
+    adata_t (*)[DEV_TILESZ]);
+struct mixgrp *dev_mixgrp_ref(struct dev *, struct slot *);
+void dev_mixgrp_unref(struct dev *, struct mixgrp *);
+void dev_mix_adjvol(struct dev *, struct slot *, int);
+int dev_mix_weight(struct dev *, struct slot *);
+void dev_mix_resetvol(struct dev *);
+void dev_sub_bcopy(struct dev *, struct slot *, adata_t (*)[DEV_TILESZ]);
+struct subgrp *dev_subgrp_ref(struct dev *, struct slot *);
+void dev_subgrp_unref(struct dev *, struct subgrp *);
+#ifdef USE_THREADS
+void dev_mix_bdec(struct dev *, struct slot *);
+void dev_mixgrp_bresamp(struct dev *, struct mixgrp *,
+    adata_t (*)[DEV_TILESZ]);
+void dev_subgrp_bcopy(struct dev *, struct subgrp *,
+    adata_t (*)[DEV_TILESZ]);
+void dev_addjob(struct dev *, int, void *);
+void dev_mix_queue(struct dev *, struct slot *);
+void dev_sub_queue(struct dev *, struct slot *);
+void dev_job(void *, int, int);
+void dev_runjobs(struct dev *);
+int slot_deliver(struct slot *, int, unsigned int);
+#endif
 
 void dev_onmove(struct dev *, int);
+int dev_isidle(struct dev *);
+void dev_idle(struct dev *);
 void dev_master(struct dev *, unsigned int);
 void dev_cycle(struct dev *);
 int dev_allocbufs(struct dev *);
 void dev_freebufs(struct dev *);
+void dev_initpar(struct dev *);
+int dev_reopen(struct dev *, unsigned int);
+int dev_inuse(struct dev *, struct slot *);
 int dev_ref(struct dev *);
 void dev_unref(struct dev *);
 int dev_init(struct dev *);
@@ -55,6 +89,8 @@ unsigned int dev_roundof(struct dev *, unsigned int);
 void dev_wakeup(struct dev *);
 
 void slot_del(struct slot *);
+struct slot *slot_get(void);
+void slot_put(struct slot *);
 void slot_ready(struct slot *);
 void slot_allocbufs(struct slot *);
 void slot_freebufs(struct slot *);
@@ -82,8 +118,26 @@ unsigned int dev_sndnum = 0;
  */
 int dev_rate, dev_bufsz, dev_round;
 
+/*
+ * real-time priority of the audio path, 0 if disabled
+ */
+int dev_rtprio;
+
 struct ctlslot ctlslot_array[DEV_NCTLSLOT];
-struct slot slot_array[DEV_NSLOT];
+
+/*
+ * Audio clients are allocated on demand, up to slot_max, and are
+ * never freed: unused ones are kept on the free list for reuse
+ */
+struct slot *slot_inuse_list = NULL, *slot_free_list = NULL;
+unsigned int slot_count = 0, slot_max = DEV_NSLOT;
+
+#ifdef USE_THREADS
+/*
+ * conversion tiles of the worker threads
+ */
+adata_t dev_wtile[WORKER_NMAX][2][DEV_TILESZ];
+#endif
 
 /*
  * we support/need a single MTC clock source only
@@ -123,9 +177,9 @@ zomb_eof(void *arg)
 	struct slot *s = arg;
 
 #ifdef DEBUG
-	logx(3, "slot%zu: %s", s - slot_array, __func__);
+	logx(3, "slot%u: %s", s->num, __func__);
 #endif
-	s->ops = NULL;
+	slot_put(s);
 }
 
 void
@@ -134,7 +188,7 @@ zomb_exit(void *arg)
 #ifdef DEBUG
 	struct slot *s = arg;
 
-	logx(3, "slot%zu: %s", s - slot_array, __func__);
+	logx(3, "slot%u: %s", s->num, __func__);
 #endif
 }
 
@@ -342,14 +396,14 @@ slot_skip(struct slot *s)
 				break;
 		}
 		if (s->mode & MODE_PLAY) {
-			if (s->mix.buf.used < s->round * s->mix.bpf)
+			if (abuf_used(&s->mix.buf) < s->round * s->mix.bpf)
 				break;
 		}
 #ifdef DEBUG
-		logx(4, "slot%zu: skipped a cycle", s - slot_array);
+		logx(4, "slot%u: skipped a cycle", s->num);
 #endif
 		if (s->pstate != SLOT_STOP && (s->mode & MODE_RECMASK)) {
-			if (s->sub.encbuf)
+			if (s->sub.encoding)
 				enc_sil_do(&s->sub.enc, data, s->round);
 			else
 				memset(data, 0, s->round * s->sub.bpf);
@@ -364,20 +418,89 @@ slot_skip(struct slot *s)
 }
 
 /*
- * Mix the slot input block over the output block
+ * Notify the slot client of the given event. Clients can't be
+ * notified from the device thread, so the event is queued, and
+ * the main thread delivers it later in dev_notify(), in the same
+ * order. Consecutive occurrences of the same event are counted in
+ * a single entry. If the queue is full, which happens only if the
+ * main thread is stuck for many cycles, events are just counted
+ * and delivered after the queued ones.
  */
 void
-dev_mix_badd(struct dev *d, struct slot *s)
+slot_notify(struct slot *s, int ev)
 {
-	adata_t *idata, *odata, *in;
+#ifdef USE_THREADS
+	struct dev *d = s->opt->dev;
+
+	if (DEV_ASYNC(d)) {
+		if (s->nevq == SLOT_NEVQ)
+			s->pend[ev]++;
+		else if (s->nevq > 0 && s->evq[s->nevq - 1].ev == ev)
+			s->evq[s->nevq - 1].n++;
+		else {
+			s->evq[s->nevq].ev = ev;
+			s->evq[s->nevq].n = 1;
+			s->nevq++;
+		}
+		d->sio.pending = 1;
+		return;
+	}
+#endif
+	switch (ev) {
+	case SLOT_MOVE:
+		s->ops->onmove(s->arg);
+		break;
+	case SLOT_XRUN:
+		s->ops->onxrun(s->arg);
+		break;
+	case SLOT_FLUSH:
+		s->ops->flush(s->arg);
+		break;
+	case SLOT_FILL:
+		s->ops->fill(s->arg);
+		break;
+	case SLOT_EOF:
+		s->ops->eof(s->arg);
+		break;
+	case SLOT_EXIT:
+		s->ops->exit(s->arg);
+		break;
+	}
+}
+
+/*
+ * Return true if the slot input block is silence. Only encodings
+ * where silence is made of zero bytes are checked
+ */
+int
+dev_mix_bsil(struct slot *s)
+{
+	unsigned char *idata;
 	int icount;
 
-	odata = DEV_PBUF(d);
-	idata = (adata_t *)abuf_rgetblk(&s->mix.buf, &icount);
+	if (!s->par.sig && !s->par.flt)
+		return 0;
+	idata = abuf_rgetblk(&s->mix.buf, &icount);
+	return sil_test(idata, s->round * s->mix.bpf);
+}
+
+/*
+ * Mix the slot input block over the output block
+ */
+void
+dev_mix_badd(struct dev *d, struct slot *s, adata_t (*tile)[DEV_TILESZ])
+{
+	struct mixgrp *g = s->mix.grp;
+	adata_t *odata, *in;
+	unsigned char *idata;
+	int icount, cnt, todo, maxfr, vol, ochan, mix, decoding, ibpf;
+	long long t0;
+
+	idata = abuf_rgetblk(&s->mix.buf, &icount);
 #ifdef DEBUG
 	if (icount < s->round * s->mix.bpf) {
-		logx(0, "slot%zu: not enough data to mix (%u bytes)",
-		     s - slot_array, icount);
+		logx(0, "slot%u: not enough data to mix (%u bytes)",
+		     s->num, icount);
 		panic();
 	}
 #endif
@@ -389,88 +512,393 @@ dev_mix_badd(struct dev *d, struct slot *s)
 		return;
 	}
 
+	/*
+	 * adding silence changes nothing, skip the processing chain. The
+	 * group is still resampled, see dev_mixgrp_bskip()
+	 */
+	if (s->mix.silent) {
+		if (g != NULL)
+			g->nsil++;
+#ifdef USE_THREADS
+		s->mix.decoded = 0;
+#endif
+		abuf_rdiscard(&s->mix.buf, s->round * s->mix.bpf);
+		return;
+	}
+
+	t0 = dev_nsec();
+	decoding = s->mix.decoding;
+	ibpf = s->mix.bpf;
+#ifdef USE_THREADS
+	/*
+	 * a worker thread may have decoded the block already
+	 */
+	if (s->mix.decoded) {
+		s->mix.decoded = 0;
+		idata = (unsigned char *)s->mix.decbuf;
+		decoding = 0;
+		ibpf = s->mix.nch * sizeof(adata_t);
+	}
+#endif
 
 	/*
 	 * Apply the following processing chain:
 	 *
-	 *	dec -> resamp-> cmap
+	 *	dec -> cmap
+	 *
+	 * where the first is optional. If the slot needs resampling,
+	 * cmap is replaced by sum_do() that only applies the volume and
+	 * adds the result to the group block, resampled later by
+	 * dev_mixgrp_badd(). The first slot of the group overwrites the
+	 * previous group block. The group block is not clipped, so the
+	 * result is the same as resampling each slot separately; it's
+	 * clipped once resampled and mixed to the device block. It's
+	 * only saturated far above full scale to avoid overflows.
 	 *
-	 * where the first two are optional.
+	 * The block is processed in tiles going through all the
+	 * stages, so intermediate results stay in the cache.
 	 */
 
-	in = idata;
+	vol = ADATA_MUL(dev_mix_weight(d, s), s->mix.vol);
+	if (g != NULL) {
+		odata = g->buf;
+		ochan = s->mix.nch;
+		mix = (g->nmix++ > 0);
+	} else {
+		odata = DEV_PBUF(d);
+		ochan = d->pchan;
+		mix = 1;
+	}
+	maxfr = decoding ? DEV_TILESZ / s->mix.nch : s->round;
+	for (todo = s->round; todo > 0; todo -= cnt) {
+		cnt = (todo < maxfr) ? todo : maxfr;
+		in = (adata_t *)idata;
+		if (decoding) {
+			dec_do(&s->mix.dec, idata, (void *)tile[0], cnt);
+			in = tile[0];
+		}
+		if (g != NULL)
+			sum_do(in, odata, vol, cnt * ochan, mix);
+		else
+			cmap_do(&s->mix.cmap, in, odata, vol, cnt, mix);
+		idata += cnt * ibpf;
+		odata += cnt * ochan;
+	}
+
+	abuf_rdiscard(&s->mix.buf, s->round * s->mix.bpf);
+	s->play_ns += dev_nsec() - t0;
+}
 
-	if (s->mix.decbuf) {
-		dec_do(&s->mix.dec, (void *)in, s->mix.decbuf, s->round);
-		in = s->mix.decbuf;
+/*
+ * Called once the group slots are mixed. If they were all silent
+ * and the resampler history contains only zeros, the resampled block
+ * is silence: advance the resampler state and return true, so the
+ * caller skips it. Otherwise, zero the group block if needed, so the
+ * resampler flushes the previous signal
+ */
+int
+dev_mixgrp_bskip(struct dev *d, struct mixgrp *g)
+{
+	if (g->stale) {
+		/*
+		 * the history dates from the last time the group was
+		 * resampled, drop it so it doesn't cause a transient,
+		 * new slots start with an empty history as well
+		 */
+		resamp_reset(&g->resamp);
+		g->nzero = g->resamp.ctx_len;
+		g->stale = 0;
 	}
+	if (g->nmix > 0) {
+		g->nzero = 0;
+		return 0;
+	}
+	if (g->nzero < g->resamp.ctx_len) {
+		memset(g->buf, 0, g->round * g->nch * sizeof(adata_t));
+		g->nzero += g->round;
+		g->nmix = 1;
+		return 0;
+	}
+	resamp_skip(&g->resamp, g->round, d->round);
+	return 1;
+}
 
-	if (s->mix.resampbuf) {
-		resamp_do(&s->mix.resamp,
-		    in, s->mix.resampbuf, s->round, d->round);
-		in = s->mix.resampbuf;
+/*
+ * Resample the sum of the group slots and mix it over the output block
+ */
+void
+dev_mixgrp_badd(struct dev *d, struct mixgrp *g,
+    adata_t (*tile)[DEV_TILESZ])
+{
+	adata_t *idata, *odata;
+	int icnt, ocnt, itodo, otodo, maxfr;
+	long long t0;
+
+	/*
+	 * if no slot was mixed, the group block is stale and so will
+	 * be the resampler history
+	 */
+	if (g->nmix == 0 && g->nsil == 0) {
+		g->stale = 1;
+		return;
 	}
 
-	cmap_do(&s->mix.cmap, in, odata,
-	    ADATA_MUL(s->mix.weight, s->mix.vol),
-	    d->round, 1);
+#ifdef USE_THREADS
+	/*
+	 * a worker thread resampled the sum already
+	 */
+	if (g->out != NULL) {
+		if (g->nmix > 0) {
+			cmap_do(&g->cmap, g->out, DEV_PBUF(d),
+			    ADATA_UNIT, d->round, 1);
+		}
+		g->nmix = g->nsil = 0;
+		return;
+	}
+#endif
+	if (dev_mixgrp_bskip(d, g)) {
+		g->nsil = 0;
+		return;
+	}
+	g->nmix = g->nsil = 0;
 
-	abuf_rdiscard(&s->mix.buf, s->round * s->mix.bpf);
+	t0 = dev_nsec();
+	idata = g->buf;
+	odata = DEV_PBUF(d);
+	maxfr = DEV_TILESZ / g->nch;
+	itodo = g->round;
+	otodo = d->round;
+	while (itodo > 0 || otodo > 0) {
+		icnt = (itodo < maxfr) ? itodo : maxfr;
+		ocnt = (otodo < maxfr) ? otodo : maxfr;
+
+		/*
+		 * once all output is produced, the remaining
+		 * input only feeds the resampler history
+		 */
+		if (ocnt > 0)
+			resamp_getcnt(&g->resamp, &icnt, &ocnt);
+
+		resamp_do(&g->resamp, idata, tile[1], icnt, ocnt);
+		cmap_do(&g->cmap, tile[1], odata, ADATA_UNIT, ocnt, 1);
+
+		idata += icnt * g->nch;
+		odata += ocnt * d->pchan;
+		itodo -= icnt;
+		otodo -= ocnt;
+	}
+#ifdef DEBUG
+	if (itodo != 0) {
+		logx(0, "%s: %d Hz group: %d: frames not mixed",
+		    d->path, g->rate, itodo);
+		panic();
+	}
+#endif
+	g->resamp_ns += dev_nsec() - t0;
+	g->ncycles++;
 }
 
 /*
- * Normalize input levels.
+ * Return the group the given slot is resampled with, create it if
+ * there's none with the same rate and channel range
+ */
+struct mixgrp *
+dev_mixgrp_ref(struct dev *d, struct slot *s)
+{
+	struct mixgrp *g;
+
+	for (g = d->mixgrp_list; g != NULL; g = g->next) {
+		if (g->rate == s->rate && g->nch == s->mix.nch &&
+		    g->pmin == s->opt->pmin && g->pmax == s->opt->pmax &&
+		    g->dup == s->opt->dup) {
+			g->refs++;
+			return g;
+		}
+	}
+
+	g = xbuf_get(sizeof(struct mixgrp));
+	g->refs = 1;
+	g->rate = s->rate;
+	g->round = s->round;
+	g->nch = s->mix.nch;
+	g->pmin = s->opt->pmin;
+	g->pmax = s->opt->pmax;
+	g->dup = s->opt->dup;
+	g->nmix = 0;
+	g->nsil = 0;
+	g->nzero = 0;
+	g->stale = 0;
+	g->ncycles = 0;
+	g->resamp_ns = 0;
+	g->buf = xbuf_get(g->round * g->nch * sizeof(adata_t));
+#ifdef USE_THREADS
+	g->queued = 0;
+	g->out = (worker_count > 0) ?
+	    xbuf_get(d->round * g->nch * sizeof(adata_t)) : NULL;
+#endif
+	resamp_init(&g->resamp, g->round, d->round, g->nch);
+	cmap_init(&g->cmap,
+	    g->pmin, g->pmin + g->nch - 1,
+	    g->pmin, g->pmin + g->nch - 1,
+	    0, d->pchan - 1,
+	    g->pmin, g->pmax,
+	    g->dup);
+	g->next = d->mixgrp_list;
+	d->mixgrp_list = g;
+#ifdef DEBUG
+	logx(3, "%s: %d Hz, %d channel group created",
+	    d->path, g->rate, g->nch);
+#endif
+	return g;
+}
+
+/*
+ * Release the given group, free it if it's not used anymore
  */
 void
-dev_mix_adjvol(struct dev *d)
+dev_mixgrp_unref(struct dev *d, struct mixgrp *g)
 {
-	unsigned int n;
-	struct slot *i, *j;
-	int jcmax, icmax, weight;
+	struct mixgrp **pg;
 
-	for (i = d->slot_list; i != NULL; i = i->next) {
-		if (!(i->mode & MODE_PLAY))
-			continue;
-		icmax = i->opt->pmin + i->mix.nch - 1;
-		weight = ADATA_UNIT;
-		if (d->autovol) {
-			/*
-			 * count the number of inputs that have
-			 * overlapping channel sets
-			 */
-			n = 0;
-			for (j = d->slot_list; j != NULL; j = j->next) {
-				if (!(j->mode & MODE_PLAY))
-					continue;
-				jcmax = j->opt->pmin + j->mix.nch - 1;
-				if (i->opt->pmin <= jcmax &&
-				    icmax >= j->opt->pmin)
-					n++;
-			}
-			weight /= n;
+	if (--g->refs > 0)
+		return;
+
+	for (pg = &d->mixgrp_list; *pg != g; pg = &(*pg)->next) {
+#ifdef DEBUG
+		if (*pg == NULL) {
+			logx(0, "%s: group not on list", d->path);
+			panic();
 		}
-		if (weight > i->opt->maxweight)
-			weight = i->opt->maxweight;
-		i->mix.weight = d->master_enabled ?
-		    ADATA_MUL(weight, MIDI_TO_ADATA(d->master)) : weight;
+#endif
+	}
+	*pg = g->next;
 #ifdef DEBUG
-		logx(3, "slot%zu: set weight: %d / %d", i - slot_array, i->mix.weight,
-		    i->opt->maxweight);
+	logx(3, "%s: %d Hz, %d channel group freed",
+	    d->path, g->rate, g->nch);
 #endif
+	resamp_done(&g->resamp);
+#ifdef USE_THREADS
+	if (g->out != NULL)
+		xbuf_put(g->out);
+#endif
+	xbuf_put(g->buf);
+	xbuf_put(g);
+}
+
+/*
+ * Account for the channel range of the given play slot, called with
+ * delta = 1 when the slot is attached and delta = -1 when it's
+ * detached. It's independent of the number of slots.
+ */
+void
+dev_mix_adjvol(struct dev *d, struct slot *s, int delta)
+{
+	int c, cmin, cmax;
+
+	cmin = s->opt->pmin;
+	cmax = cmin + s->mix.nch - 1;
+	d->mix_nslot += delta;
+	for (c = cmax + 1; c < NCHAN_MAX; c++)
+		d->mix_nbelow[c] += delta;
+	for (c = 0; c < cmin; c++)
+		d->mix_nabove[c] += delta;
+}
+
+/*
+ * Forget all play slots, as if they were detached
+ */
+void
+dev_mix_resetvol(struct dev *d)
+{
+	d->mix_nslot = 0;
+	memset(d->mix_nbelow, 0, sizeof(d->mix_nbelow));
+	memset(d->mix_nabove, 0, sizeof(d->mix_nabove));
+}
+
+/*
+ * Return the weight of the given play slot, used to normalize input
+ * levels: in auto volume mode, it's divided by the number of inputs
+ * that have overlapping channel sets, including the slot itself
+ */
+int
+dev_mix_weight(struct dev *d, struct slot *s)
+{
+	int n, cmin, cmax, weight;
+
+	weight = ADATA_UNIT;
+	if (d->autovol) {
+		cmin = s->opt->pmin;
+		cmax = cmin + s->mix.nch - 1;
+		n = d->mix_nslot - d->mix_nbelow[cmin] - d->mix_nabove[cmax];
+		weight /= n;
+	}
+	if (weight > s->opt->maxweight)
+		weight = s->opt->maxweight;
+	return d->master_enabled ?
+	    ADATA_MUL(weight, MIDI_TO_ADATA(d->master)) : weight;
+}
+
+/*
+ * Return the slot whose data can be sent to the device as is: the
+ * only one attached, using an opt in exclusive mode, with the device
+ * parameters and full volume. Monitoring needs the mixer output,
+ * so it must not be allowed on any opt using the device.
+ */
+struct slot *
+dev_mix_excl(struct dev *d)
+{
+	struct slot *s = d->slot_list;
+	struct opt *o;
+
+	if (s == NULL || s->next != NULL || !s->opt->excl)
+		return NULL;
+	for (o = opt_list; o != NULL; o = o->next) {
+		if (o->dev == d && (o->mode & MODE_MON))
+			return NULL;
 	}
+	if ((s->mode & (MODE_PLAY | MODE_MON)) != MODE_PLAY ||
+	    !(s->opt->mode & MODE_PLAY))
+		return NULL;
+	if (s->rate != d->rate || s->mix.nch != d->pchan ||
+	    s->opt->pmin != 0)
+		return NULL;
+	if (s->par.bps != d->par.bps || s->par.bits != d->par.bits ||
+	    s->par.sig != d->par.sig || s->par.le != d->par.le ||
+	    s->par.msb != d->par.msb || s->par.flt != d->par.flt)
+		return NULL;
+	if (ADATA_MUL(dev_mix_weight(d, s), s->mix.vol) != ADATA_UNIT)
+		return NULL;
+	return s;
+}
+
+/*
+ * Copy the slot block to the device block, already encoded
+ */
+void
+dev_mix_bcopy(struct dev *d, struct slot *s)
+{
+	unsigned char *idata, *odata;
+	int icount;
+
+	idata = abuf_rgetblk(&s->mix.buf, &icount);
+	odata = d->encbuf ? d->encbuf : (unsigned char *)DEV_PBUF(d);
+	memcpy(odata, idata, s->round * s->mix.bpf);
+	abuf_rdiscard(&s->mix.buf, s->round * s->mix.bpf);
 }
 
 /*
  * Copy data from slot to device
  */
 void
-dev_sub_bcopy(struct dev *d, struct slot *s)
+dev_sub_bcopy(struct dev *d, struct slot *s, adata_t (*tile)[DEV_TILESZ])
 {
-	adata_t *enc_out, *resamp_out, *cmap_out;
-	void *odata;
-	int ocount, moffs, mix;
+	struct subgrp *g = s->sub.grp;
+	adata_t *cmap_out, *resamp_out, *mon, *rec;
+	unsigned char *odata, *obase;
+	int ocount, moffs, mix, icnt, ocnt, itodo, otodo, maxfr;
+	long long t0;
 
-	odata = (adata_t *)abuf_wgetblk(&s->sub.buf, &ocount);
+	odata = abuf_wgetblk(&s->sub.buf, &ocount);
 #ifdef DEBUG
 	if (ocount < s->round * s->sub.bpf) {
 		logx(0, "dev_sub_bcopy: not enough space");
@@ -481,7 +909,7 @@ dev_sub_bcopy(struct dev *d, struct slot *s)
 		/*
 		 * recording not allowed in opt structure, produce silence
 		 */
-		if (s->sub.encbuf)
+		if (s->sub.encoding)
 			enc_sil_do(&s->sub.enc, odata, s->round);
 		else
 			memset(odata, 0, s->round * s->sub.bpf);
@@ -489,39 +917,349 @@ dev_sub_bcopy(struct dev *d, struct slot *s)
 		return;
 	}
 
+	/*
+	 * if another slot of the group already converted this block,
+	 * just copy it
+	 */
+	if (g != NULL && g->ready) {
+		memcpy(odata, g->buf, s->round * s->sub.bpf);
+		abuf_wcommit(&s->sub.buf, s->round * s->sub.bpf);
+		return;
+	}
+
 	/*
 	 * Apply the following processing chain:
 	 *
 	 *	cmap -> resamp -> enc
 	 *
-	 * where the last two are optional.
+	 * where the last two are optional. As for playback, the block
+	 * is processed in tiles going through all the stages.
 	 */
 
-	enc_out = odata;
-	resamp_out = s->sub.encbuf ? s->sub.encbuf : enc_out;
-	cmap_out = s->sub.resampbuf ? s->sub.resampbuf : resamp_out;
-	mix = 0;
+	t0 = dev_nsec();
+	moffs = d->poffs + d->round;
+	if (moffs == d->psize)
+		moffs = 0;
+	mon = d->pbuf + moffs * d->pchan;
+	rec = d->rbuf;
+	obase = odata;
+	maxfr = DEV_TILESZ / s->sub.nch;
+	itodo = d->round;
+	otodo = s->round;
+	while (itodo > 0 || otodo > 0) {
+		icnt = itodo;
+		ocnt = otodo;
+		if (s->sub.encoding || s->sub.resampling) {
+			if (icnt > maxfr)
+				icnt = maxfr;
+			if (ocnt > maxfr)
+				ocnt = maxfr;
+		}
+		if (s->sub.resampling) {
+			/*
+			 * once all output is produced, the remaining
+			 * input only feeds the resampler history
+			 */
+			if (ocnt > 0)
+				resamp_getcnt(&g->resamp, &icnt, &ocnt);
+		} else if (icnt < ocnt)
+			ocnt = icnt;
+		else
+			icnt = ocnt;
+
+		resamp_out = s->sub.encoding ?
+		    tile[1] : (adata_t *)odata;
+		cmap_out = s->sub.resampling ? tile[0] : resamp_out;
+
+		/*
+		 * cmap_do() doesn't write samples in all channels,
+		 * for instance when mono->stereo conversion is
+		 * disabled. So we have to prefill tiles with silence;
+		 * the slot buffer was zeroed by slot_initconv().
+		 */
+		if (cmap_out != (adata_t *)odata)
+			memset(cmap_out, 0, icnt * s->sub.nch * sizeof(adata_t));
+
+		mix = 0;
+		if (s->opt->mode & MODE_MON) {
+			cmap_do(&s->sub.cmap_mon, mon, cmap_out,
+			    ADATA_UNIT, icnt, mix++);
+		}
+		if (s->opt->mode & MODE_REC) {
+			cmap_do(&s->sub.cmap_rec, rec, cmap_out,
+			    ADATA_UNIT, icnt, mix++);
+		}
+		if (s->sub.resampling) {
+			resamp_do(&g->resamp,
+			    cmap_out, resamp_out, icnt, ocnt);
+		}
+		if (s->sub.encoding) {
+			enc_do(&s->sub.enc,
+			    (void *)resamp_out, odata, ocnt);
+		}
 
-	if (s->opt->mode & MODE_MON) {
-		moffs = d->poffs + d->round;
-		if (moffs == d->psize)
-			moffs = 0;
-		cmap_do(&s->sub.cmap_mon, d->pbuf + moffs * d->pchan, cmap_out,
-		    ADATA_UNIT, d->round, mix++);
+		mon += icnt * d->pchan;
+		rec += icnt * d->rchan;
+		odata += ocnt * s->sub.bpf;
+		itodo -= icnt;
+		otodo -= ocnt;
 	}
-	if (s->opt->mode & MODE_REC) {
-		cmap_do(&s->sub.cmap_rec, d->rbuf, cmap_out,
-		    ADATA_UNIT, d->round, mix++);
+#ifdef DEBUG
+	if (itodo != 0) {
+		logx(0, "slot%u: %d: frames not copied", s->num, itodo);
+		panic();
 	}
-	if (s->sub.resampbuf) {
-		resamp_do(&s->sub.resamp,
-		    s->sub.resampbuf, resamp_out, d->round, s->round);
+#endif
+
+	if (g != NULL && g->refs > 1) {
+		memcpy(g->buf, obase, s->round * s->sub.bpf);
+		g->ready = 1;
 	}
-	if (s->sub.encbuf)
-		enc_do(&s->sub.enc, s->sub.encbuf, (void *)enc_out, s->round);
 
-	abuf_wcommit(&s->sub.buf, s->round * s->sub.bpf);
+	abuf_wcommit(&s->sub.buf, s->round * s->sub.bpf);
+	s->rec_ns += dev_nsec() - t0;
+}
+
+/*
+ * Return the group the given slot is converted with, create it if
+ * there's none with the same parameters
+ */
+struct subgrp *
+dev_subgrp_ref(struct dev *d, struct slot *s)
+{
+	struct subgrp *g;
+
+	for (g = d->subgrp_list; g != NULL; g = g->next) {
+		if (g->opt == s->opt && g->rate == s->rate &&
+		    g->nch == s->sub.nch &&
+		    g->par.bps == s->par.bps &&
+		    g->par.bits == s->par.bits &&
+		    g->par.le == s->par.le &&
+		    g->par.sig == s->par.sig &&
+		    g->par.msb == s->par.msb &&
+		    g->par.flt == s->par.flt) {
+			g->refs++;
+			return g;
+		}
+	}
+
+	g = xbuf_get(sizeof(struct subgrp));
+	g->refs = 1;
+	g->opt = s->opt;
+	g->par = s->par;
+	g->rate = s->rate;
+	g->nch = s->sub.nch;
+	g->ready = 0;
+#ifdef USE_THREADS
+	g->queued = 0;
+#endif
+	g->buf = xbuf_get(s->round * s->sub.bpf);
+	if (g->rate != d->rate)
+		resamp_init(&g->resamp, d->round, s->round, g->nch);
+	g->next = d->subgrp_list;
+	d->subgrp_list = g;
+#ifdef DEBUG
+	logx(3, "%s: %d Hz, %d channel rec group created",
+	    d->path, g->rate, g->nch);
+#endif
+	return g;
+}
+
+/*
+ * Release the given group, free it if it's not used anymore
+ */
+void
+dev_subgrp_unref(struct dev *d, struct subgrp *g)
+{
+	struct subgrp **pg;
+
+	if (--g->refs > 0)
+		return;
+
+	for (pg = &d->subgrp_list; *pg != g; pg = &(*pg)->next) {
+#ifdef DEBUG
+		if (*pg == NULL) {
+			logx(0, "%s: rec group not on list", d->path);
+			panic();
+		}
+#endif
+	}
+	*pg = g->next;
+#ifdef DEBUG
+	logx(3, "%s: %d Hz, %d channel rec group freed",
+	    d->path, g->rate, g->nch);
+#endif
+	if (g->rate != d->rate)
+		resamp_done(&g->resamp);
+	xbuf_put(g->buf);
+	xbuf_put(g);
+}
+
+#ifdef USE_THREADS
+/*
+ * Decode the slot block, dev_mix_badd() mixes it later
+ */
+void
+dev_mix_bdec(struct dev *d, struct slot *s)
+{
+	unsigned char *idata;
+	int icount;
+	long long t0;
+
+	t0 = dev_nsec();
+	idata = abuf_rgetblk(&s->mix.buf, &icount);
+	dec_do(&s->mix.dec, idata, (unsigned char *)s->mix.decbuf, s->round);
+	s->mix.decoded = 1;
+	s->play_ns += dev_nsec() - t0;
+}
+
+/*
+ * Mix the group slots and resample the sum, dev_mixgrp_badd() mixes
+ * it to the device block later
+ */
+void
+dev_mixgrp_bresamp(struct dev *d, struct mixgrp *g,
+    adata_t (*tile)[DEV_TILESZ])
+{
+	struct slot *s;
+	long long t0;
+
+	for (s = d->slot_list; s != NULL; s = s->next) {
+		if (s->mix.grp == g && s->mix.queued)
+			dev_mix_badd(d, s, tile);
+	}
+	if ((g->nmix > 0 || g->nsil > 0) && !dev_mixgrp_bskip(d, g)) {
+		t0 = dev_nsec();
+		resamp_do(&g->resamp, g->buf, g->out, g->round, d->round);
+		g->resamp_ns += dev_nsec() - t0;
+		g->ncycles++;
+	}
+}
+
+/*
+ * Convert the blocks of the group slots, the first one does the
+ * actual work, the others copy the result
+ */
+void
+dev_subgrp_bcopy(struct dev *d, struct subgrp *g,
+    adata_t (*tile)[DEV_TILESZ])
+{
+	struct slot *s;
+
+	for (s = d->slot_list; s != NULL; s = s->next) {
+		if (s->sub.grp == g && s->sub.queued)
+			dev_sub_bcopy(d, s, tile);
+	}
+}
+
+void
+dev_addjob(struct dev *d, int type, void *ptr)
+{
+#ifdef DEBUG
+	if (d->njobs == 2 * slot_max) {
+		logx(0, "%s: too many jobs", d->path);
+		panic();
+	}
+#endif
+	d->job[d->njobs].type = type;
+	d->job[d->njobs].ptr = ptr;
+	d->njobs++;
+}
+
+/*
+ * Queue the jobs needed to mix the slot block. As the sum saturates,
+ * slots mixed to the device block directly are mixed later by
+ * dev_runjobs(), in list order
+ */
+void
+dev_mix_queue(struct dev *d, struct slot *s)
+{
+	struct mixgrp *g = s->mix.grp;
+
+	s->mix.queued = 1;
+	if (g != NULL) {
+		if (!g->queued) {
+			g->queued = 1;
+			dev_addjob(d, DEV_JOB_MIXGRP, g);
+		}
+	} else if (s->mix.decoding && !s->mix.silent &&
+	    (s->opt->mode & MODE_PLAY))
+		dev_addjob(d, DEV_JOB_DEC, s);
+}
+
+/*
+ * Queue the job needed to copy the slot block
+ */
+void
+dev_sub_queue(struct dev *d, struct slot *s)
+{
+	struct subgrp *g = s->sub.grp;
+
+	s->sub.queued = 1;
+	if (g != NULL && g->refs > 1) {
+		if (!g->queued) {
+			g->queued = 1;
+			dev_addjob(d, DEV_JOB_SUBGRP, g);
+		}
+	} else
+		dev_addjob(d, DEV_JOB_SUB, s);
+}
+
+/*
+ * Run the given job, called by the worker threads
+ */
+void
+dev_job(void *arg, int n, int id)
+{
+	struct dev *d = arg;
+	struct dev_job *j = &d->job[n];
+	adata_t (*tile)[DEV_TILESZ];
+
+	tile = (id == 0) ? d->tilebuf : dev_wtile[id - 1];
+	switch (j->type) {
+	case DEV_JOB_DEC:
+		dev_mix_bdec(d, j->ptr);
+		break;
+	case DEV_JOB_MIXGRP:
+		dev_mixgrp_bresamp(d, j->ptr, tile);
+		break;
+	case DEV_JOB_SUB:
+		dev_sub_bcopy(d, j->ptr, tile);
+		break;
+	case DEV_JOB_SUBGRP:
+		dev_subgrp_bcopy(d, j->ptr, tile);
+		break;
+	}
+}
+
+/*
+ * Run the jobs of the cycle in parallel, then mix the slots that
+ * are not resampled, in the same order as the single-threaded code
+ */
+void
+dev_runjobs(struct dev *d)
+{
+	struct subgrp *sg;
+	struct mixgrp *g;
+	struct slot *s;
+
+	worker_run(d->njobs, dev_job, d);
+	d->njobs = 0;
+
+	for (s = d->slot_list; s != NULL; s = s->next) {
+		if (s->mix.queued) {
+			s->mix.queued = 0;
+			if (s->mix.grp == NULL)
+				dev_mix_badd(d, s, d->tilebuf);
+		}
+		s->sub.queued = 0;
+	}
+	for (g = d->mixgrp_list; g != NULL; g = g->next)
+		g->queued = 0;
+	for (sg = d->subgrp_list; sg != NULL; sg = sg->next)
+		sg->queued = 0;
 }
+#endif
 
 /*
  * run a one block cycle: consume one recorded block from
@@ -530,22 +1268,27 @@ dev_sub_bcopy(struct dev *d, struct slot *s)
 void
 dev_cycle(struct dev *d)
 {
-	struct slot *s, **ps;
+	struct mixgrp *g;
+	struct subgrp *sg;
+	struct slot *s, **ps, *excl;
 	unsigned char *base;
-	int nsamp;
+	int nsamp, raw;
+	long long t0;
 
 	/*
 	 * check if the device is actually used. If it isn't,
-	 * then close it
+	 * then close it. The device thread can't do it, so it
+	 * asks the main thread and keeps running meanwhile.
 	 */
-	if (d->slot_list == NULL && d->idle >= d->bufsz &&
-	    (mtc_array[0].dev != d || mtc_array[0].tstate != MTC_RUN)) {
-		logx(2, "%s: device stopped", d->path);
-		dev_sio_stop(d);
-		d->pstate = DEV_INIT;
-		if (d->refcnt == 0)
-			dev_close(d);
-		return;
+	if (dev_isidle(d)) {
+		if (!DEV_ASYNC(d)) {
+			dev_idle(d);
+			return;
+		}
+#ifdef USE_THREADS
+		d->sio.idle = 1;
+		d->sio.pending = 1;
+#endif
 	}
 
 	if (d->prime > 0) {
@@ -563,21 +1306,39 @@ dev_cycle(struct dev *d)
 		return;
 	}
 
+	t0 = dev_nsec();
 	d->delta -= d->round;
 #ifdef DEBUG
 	logx(4, "%s: full cycle: delta = %d", d->path, d->delta);
 #endif
-	if (d->mode & MODE_PLAY) {
+
+	/*
+	 * in exclusive mode, the slot block is copied to the device
+	 * block, the mixer is bypassed
+	 */
+	raw = 0;
+	excl = (d->mode & MODE_PLAY) ? dev_mix_excl(d) : NULL;
+	if (excl != NULL && !d->excl && d->encbuf) {
+		/*
+		 * the play buffer history isn't updated anymore, clear
+		 * it so it doesn't hold stale samples when mixing resumes
+		 */
+		memset(d->pbuf, 0, d->psize * d->pchan * sizeof(adata_t));
+	}
+	d->excl = (excl != NULL);
+	if ((d->mode & MODE_PLAY) && excl == NULL) {
 		base = (unsigned char *)DEV_PBUF(d);
 		nsamp = d->round * d->pchan;
 		memset(base, 0, nsamp * sizeof(adata_t));
 	}
 	if ((d->mode & MODE_REC) && d->decbuf)
 		dec_do(&d->dec, d->decbuf, (unsigned char *)d->rbuf, d->round);
+	for (sg = d->subgrp_list; sg != NULL; sg = sg->next)
+		sg->ready = 0;
 	ps = &d->slot_list;
 	while ((s = *ps) != NULL) {
 #ifdef DEBUG
-		logx(4, "slot%zu: running, skip = %d", s - slot_array, s->skip);
+		logx(4, "slot%u: running, skip = %d", s->num, s->skip);
 #endif
 		d->idle = 0;
 
@@ -593,8 +1354,8 @@ dev_cycle(struct dev *d)
 
 #ifdef DEBUG
 		if (s->pstate == SLOT_STOP && !(s->mode & MODE_PLAY)) {
-			logx(0, "slot%zu: rec-only slots can't be drained",
-			    s - slot_array);
+			logx(0, "slot%u: rec-only slots can't be drained",
+			    s->num);
 			panic();
 		}
 #endif
@@ -602,19 +1363,20 @@ dev_cycle(struct dev *d)
 		 * check if stopped stream finished draining
 		 */
 		if (s->pstate == SLOT_STOP &&
-		    s->mix.buf.used < s->round * s->mix.bpf) {
+		    abuf_used(&s->mix.buf) < s->round * s->mix.bpf) {
 			/*
 			 * partial blocks are zero-filled by socket
-			 * layer, so s->mix.buf.used == 0 and we can
+			 * layer, so the buffer is empty and we can
 			 * destroy the buffer
 			 */
 			*ps = s->next;
 			s->pstate = SLOT_INIT;
-			s->ops->eof(s->arg);
+			slot_notify(s, SLOT_EOF);
+			slot_doneconv(s);
 			slot_freebufs(s);
-			dev_mix_adjvol(d);
+			dev_mix_adjvol(d, s, -1);
 #ifdef DEBUG
-			logx(3, "slot%zu: drained", s - slot_array);
+			logx(3, "slot%u: drained", s->num);
 #endif
 			continue;
 		}
@@ -623,17 +1385,18 @@ dev_cycle(struct dev *d)
 		 * check for xruns
 		 */
 		if (((s->mode & MODE_PLAY) &&
-			s->mix.buf.used < s->round * s->mix.bpf) ||
+			abuf_used(&s->mix.buf) < s->round * s->mix.bpf) ||
 		    ((s->mode & MODE_RECMASK) &&
-			s->sub.buf.len - s->sub.buf.used <
+			s->sub.buf.len - abuf_used(&s->sub.buf) <
 			s->round * s->sub.bpf)) {
 
 			if (!s->paused) {
 #ifdef DEBUG
-				logx(3, "slot%zu: xrun, paused", s - slot_array);
+				logx(3, "slot%u: xrun, paused", s->num);
 #endif
+				s->nxrun++;
 				s->paused = 1;
-				s->ops->onxrun(s->arg);
+				slot_notify(s, SLOT_XRUN);
 			}
 			if (s->xrun == XRUN_IGNORE) {
 				s->delta -= s->round;
@@ -642,11 +1405,16 @@ dev_cycle(struct dev *d)
 				s->skip++;
 				ps = &s->next;
 			} else if (s->xrun == XRUN_ERROR) {
-				s->ops->exit(s->arg);
-				*ps = s->next;
+				/*
+				 * the client detaches the slot, unless the
+				 * notification is queued
+				 */
+				slot_notify(s, SLOT_EXIT);
+				if (*ps == s)
+					ps = &s->next;
 			} else {
 #ifdef DEBUG
-				logx(0, "slot%zu: bad xrun mode", s - slot_array);
+				logx(0, "slot%u: bad xrun mode", s->num);
 				panic();
 #endif
 			}
@@ -654,34 +1422,148 @@ dev_cycle(struct dev *d)
 		} else {
 			if (s->paused) {
 #ifdef DEBUG
-				logx(3, "slot%zu: resumed", s - slot_array);
+				logx(3, "slot%u: resumed", s->num);
 #endif
 				s->paused = 0;
 			}
 		}
+		s->ncycles++;
 
 		if ((s->mode & MODE_RECMASK) && !(s->pstate == SLOT_STOP)) {
 			if (s->sub.prime == 0) {
-				dev_sub_bcopy(d, s);
-				s->ops->flush(s->arg);
+#ifdef USE_THREADS
+				if (worker_count > 0)
+					dev_sub_queue(d, s);
+				else
+#endif
+					dev_sub_bcopy(d, s, d->tilebuf);
+				slot_notify(s, SLOT_FLUSH);
 			} else {
 #ifdef DEBUG
-				logx(3, "slot%zu: prime = %d", s - slot_array,
+				logx(3, "slot%u: prime = %d", s->num,
 				    s->sub.prime);
 #endif
 				s->sub.prime--;
 			}
 		}
 		if (s->mode & MODE_PLAY) {
-			dev_mix_badd(d, s);
+			if (s == excl) {
+				dev_mix_bcopy(d, s);
+				raw = 1;
+			} else {
+				s->mix.silent = dev_mix_bsil(s);
+#ifdef USE_THREADS
+				if (worker_count > 0)
+					dev_mix_queue(d, s);
+				else
+#endif
+					dev_mix_badd(d, s, d->tilebuf);
+			}
 			if (s->pstate != SLOT_STOP)
-				s->ops->fill(s->arg);
+				slot_notify(s, SLOT_FILL);
 		}
 		ps = &s->next;
 	}
-	if ((d->mode & MODE_PLAY) && d->encbuf) {
-		enc_do(&d->enc, (unsigned char *)DEV_PBUF(d),
-		    d->encbuf, d->round);
+#ifdef USE_THREADS
+	if (worker_count > 0)
+		dev_runjobs(d);
+#endif
+	for (g = d->mixgrp_list; g != NULL; g = g->next)
+		dev_mixgrp_badd(d, g, d->tilebuf);
+	if (!raw) {
+		if (excl != NULL) {
+			/*
+			 * the slot didn't play in this cycle, output silence
+			 */
+			base = (unsigned char *)DEV_PBUF(d);
+			nsamp = d->round * d->pchan;
+			memset(base, 0, nsamp * sizeof(adata_t));
+		}
+		if ((d->mode & MODE_PLAY) && d->encbuf) {
+			enc_do(&d->enc, (unsigned char *)DEV_PBUF(d),
+			    d->encbuf, d->round);
+		}
+	}
+	dev_addstats(d, dev_nsec() - t0);
+}
+
+/*
+ * return the monotonic time in nanoseconds, for statistics
+ */
+long long
+dev_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * account a cycle that took the given time
+ */
+void
+dev_addstats(struct dev *d, long long ns)
+{
+	long long lim;
+	int i;
+
+	lim = (long long)d->round * 1000000000 / d->rate;
+	for (i = DEV_NHIST - 1; i > 0; i--) {
+		if (ns >= lim)
+			break;
+		lim >>= 1;
+	}
+	d->hist[i]++;
+	d->ncycles++;
+	d->cycle_ns += ns;
+	if (d->cycle_max < ns)
+		d->cycle_max = ns;
+}
+
+/*
+ * log the cycle time histogram of the device and the processing
+ * cost of its streams, on request of the user
+ */
+void
+dev_logstats(struct dev *d)
+{
+	static const char *hist_name[DEV_NHIST] = {
+		"1/64", "1/32", "1/16", "1/8", "1/4", "1/2", "1", "more"
+	};
+	char str[128];
+	struct mixgrp *g;
+	struct slot *s;
+	int i, n;
+
+	if (d->pstate == DEV_CFG) {
+		logx(0, "%s: closed", d->path);
+		return;
+	}
+	logx(0, "%s: %llu cycles of %lld us, average %lld us, max %lld us, "
+	    "%u xruns", d->path, d->ncycles,
+	    (long long)d->round * 1000000 / d->rate,
+	    d->ncycles ? d->cycle_ns / d->ncycles / 1000 : 0,
+	    d->cycle_max / 1000, d->nxrun);
+	for (n = 0, i = 0; i < DEV_NHIST; i++) {
+		n += snprintf(str + n, sizeof(str) - n, " %s:%llu",
+		    hist_name[i], d->hist[i]);
+		if (n >= (int)sizeof(str))
+			break;
+	}
+	logx(0, "%s: cycle time per block period:%s", d->path, str);
+	for (s = d->slot_list; s != NULL; s = s->next) {
+		logx(0, "slot%u: %s: %llu cycles, play %lld ns, "
+		    "rec %lld ns per cycle, %u xruns",
+		    s->num, s->app->name, s->ncycles,
+		    s->ncycles ? s->play_ns / s->ncycles : 0,
+		    s->ncycles ? s->rec_ns / s->ncycles : 0,
+		    s->nxrun);
+	}
+	for (g = d->mixgrp_list; g != NULL; g = g->next) {
+		logx(0, "%s: %d Hz group: %llu cycles, resamp %lld ns "
+		    "per cycle", d->path, g->rate, g->ncycles,
+		    g->ncycles ? g->resamp_ns / g->ncycles : 0);
 	}
 }
 
@@ -714,12 +1596,119 @@ dev_onmove(struct dev *d, int delta)
 			s->delta--;
 		}
 		if (s->delta >= 0)
-			s->ops->onmove(s->arg);
+			slot_notify(s, SLOT_MOVE);
 	}
 
-	if (mtc_array[0].dev == d && mtc_array[0].tstate == MTC_RUN)
+	if (mtc_array[0].dev == d && mtc_array[0].tstate == MTC_RUN) {
+#ifdef USE_THREADS
+		if (DEV_ASYNC(d)) {
+			d->sio.mtcdelta += delta;
+			d->sio.pending = 1;
+			return;
+		}
+#endif
 		mtc_midi_qfr(&mtc_array[0], delta);
+	}
+}
+
+/*
+ * return true if the device runs, but has no clients anymore
+ */
+int
+dev_isidle(struct dev *d)
+{
+	return d->slot_list == NULL && d->idle >= d->bufsz &&
+	    (mtc_array[0].dev != d || mtc_array[0].tstate != MTC_RUN);
+}
+
+/*
+ * stop the idle device, and close it if it's not used. If it's kept
+ * open, restore the default block size, in case a lone client made
+ * it smaller, unless a new client already uses the current one
+ */
+void
+dev_idle(struct dev *d)
+{
+	logx(2, "%s: device stopped", d->path);
+	dev_sio_stop(d);
+	d->pstate = DEV_INIT;
+	if (d->refcnt == 0)
+		dev_close(d);
+	else if (d->reqround != dev_round && !dev_inuse(d, NULL) &&
+	    !dev_reopen(d, dev_round)) {
+		dev_migrate(d);
+		dev_abort(d);
+	}
+}
+
+#ifdef USE_THREADS
+/*
+ * deliver 'n' queued occurrences of the given event, return 0 if the
+ * slot was released meanwhile
+ */
+int
+slot_deliver(struct slot *s, int ev, unsigned int n)
+{
+	/*
+	 * only counted events are delivered repeatedly
+	 */
+	if (ev != SLOT_MOVE && ev != SLOT_FLUSH && ev != SLOT_FILL)
+		n = 1;
+	while (n-- > 0) {
+		slot_notify(s, ev);
+		if (s->ops == NULL)
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * deliver notifications queued by the device thread, called by the
+ * main thread
+ */
+void
+dev_notify(struct dev *d)
+{
+	struct slot *s, *snext;
+	unsigned int i, n, nevq;
+	int ev;
+
+	for (s = slot_inuse_list; s != NULL; s = snext) {
+		snext = s->pool_next;
+		if (s->ops == NULL || s->opt == NULL || s->opt->dev != d)
+			continue;
+		nevq = s->nevq;
+		s->nevq = 0;
+		for (i = 0; i < nevq; i++) {
+			if (!slot_deliver(s, s->evq[i].ev, s->evq[i].n))
+				break;
+		}
+		if (i < nevq)
+			continue;
+		for (ev = 0; ev < SLOT_NEV; ev++) {
+			n = s->pend[ev];
+			if (n == 0)
+				continue;
+			s->pend[ev] = 0;
+			if (!slot_deliver(s, ev, n))
+				break;
+		}
+	}
+
+	if (d->sio.mtcdelta != 0) {
+		if (mtc_array[0].dev == d && mtc_array[0].tstate == MTC_RUN)
+			mtc_midi_qfr(&mtc_array[0], d->sio.mtcdelta);
+		d->sio.mtcdelta = 0;
+	}
+
+	if (d->sio.idle) {
+		d->sio.idle = 0;
+		if (d->pstate == DEV_RUN && dev_isidle(d))
+			dev_idle(d);
+	}
 }
+#endif
+
 
 void
 dev_master(struct dev *d, unsigned int master)
@@ -730,9 +1719,10 @@ dev_master(struct dev *d, unsigned int master)
 	logx(2, "%s: master volume set to %u", d->path, master);
 
 	if (d->master_enabled) {
+		/*
+		 * dev_mix_weight() uses it in the next cycle
+		 */
 		d->master = master;
-		if (d->mode & MODE_PLAY)
-			dev_mix_adjvol(d);
 	} else {
 		for (c = ctl_list; c != NULL; c = c->next) {
 			if (c->scope != CTL_HW || c->u.hw.dev != d)
@@ -752,7 +1742,8 @@ dev_master(struct dev *d, unsigned int master)
  * Create a sndio device
  */
 struct dev *
-dev_new(char *path, struct aparams *par, unsigned int hold, unsigned int autovol)
+dev_new(char *path, struct aparams *par,
+    unsigned int hold, unsigned int autovol, unsigned int thread)
 {
 	struct dev *d, **pd;
 
@@ -766,11 +1757,20 @@ dev_new(char *path, struct aparams *par, unsigned int hold, unsigned int autovol
 
 	d->reqpar = *par;
 	d->reqpchan = d->reqrchan = 0;
+	d->reqround = 0;
 	d->hold = hold;
 	d->autovol = autovol;
+	d->thread = thread;
 	d->refcnt = 0;
 	d->pstate = DEV_CFG;
 	d->slot_list = NULL;
+	dev_mix_resetvol(d);
+	d->mixgrp_list = NULL;
+	d->subgrp_list = NULL;
+#ifdef USE_THREADS
+	d->job = NULL;
+	d->njobs = 0;
+#endif
 	d->master = MIDI_MAXCTL;
 	d->master_enabled = 0;
 	snprintf(d->name, CTL_NAMEMAX, "%u", d->num);
@@ -810,12 +1810,12 @@ dev_allocbufs(struct dev *d)
 	 */
 
 	 /* Create device <-> demuxer buffer */
-	d->rbuf = xmalloc(d->round * d->rchan * sizeof(adata_t));
+	d->rbuf = xbuf_get(d->round * d->rchan * sizeof(adata_t));
 
 	/* Insert a converter, if needed. */
 	if (!aparams_native(&d->par)) {
 		dec_init(&d->dec, &d->par, d->rchan);
-		d->decbuf = xmalloc(d->round * d->rchan * d->par.bps);
+		d->decbuf = xbuf_get(d->round * d->rchan * d->par.bps);
 	} else
 		d->decbuf = NULL;
 
@@ -826,13 +1826,14 @@ dev_allocbufs(struct dev *d)
 	/* Create device <-> mixer buffer */
 	d->poffs = 0;
 	d->psize = d->bufsz + d->round;
-	d->pbuf = xmalloc(d->psize * d->pchan * sizeof(adata_t));
+	d->pbuf = xbuf_get(d->psize * d->pchan * sizeof(adata_t));
 	d->mode |= MODE_MON;
+	d->excl = 0;
 
 	/* Append a converter, if needed. */
 	if (!aparams_native(&d->par)) {
 		enc_init(&d->enc, &d->par, d->pchan);
-		d->encbuf = xmalloc(d->round * d->pchan * d->par.bps);
+		d->encbuf = xbuf_get(d->round * d->pchan * d->par.bps);
 	} else
 		d->encbuf = NULL;
 
@@ -843,6 +1844,26 @@ dev_allocbufs(struct dev *d)
 	 */
 	memset(d->rbuf, 0, d->round * d->rchan * sizeof(adata_t));
 
+#ifdef USE_THREADS
+	/*
+	 * At most one job per slot, plus one per group
+	 */
+	if (worker_count > 0)
+		d->job = xmalloc(2 * slot_max * sizeof(struct dev_job));
+#endif
+
+	/*
+	 * In real-time mode, touch the other buffers as well, so the
+	 * first cycles don't page fault
+	 */
+	if (dev_rtprio > 0) {
+		memset(d->pbuf, 0, d->psize * d->pchan * sizeof(adata_t));
+		if (d->decbuf)
+			memset(d->decbuf, 0, d->round * d->rchan * d->par.bps);
+		if (d->encbuf)
+			memset(d->encbuf, 0, d->round * d->pchan * d->par.bps);
+	}
+
 	logx(2, "%s: %dHz, %s, %s, %d blocks of %d frames",
 	    d->path, d->rate,
 	    (aparams_enctostr(&d->par, enc_str), enc_str),
@@ -855,14 +1876,16 @@ dev_allocbufs(struct dev *d)
 }
 
 /*
- * Reset parameters and open the device.
+ * Reset parameters to the requested ones, before opening the device
  */
-int
-dev_open(struct dev *d)
+void
+dev_initpar(struct dev *d)
 {
 	d->mode = MODE_AUDIOMASK;
-	d->round = dev_round;
-	d->bufsz = dev_bufsz;
+	if (d->reqround == 0)
+		d->reqround = dev_round;
+	d->round = d->reqround;
+	d->bufsz = (long long)dev_bufsz * d->reqround / dev_round;
 	d->rate = dev_rate;
 	d->pchan = d->reqpchan;
 	d->rchan = d->reqrchan;
@@ -871,6 +1894,15 @@ dev_open(struct dev *d)
 		d->pchan = 2;
 	if (d->rchan == 0)
 		d->rchan = 2;
+}
+
+/*
+ * Reset parameters and open the device.
+ */
+int
+dev_open(struct dev *d)
+{
+	dev_initpar(d);
 	if (!dev_sio_open(d)) {
 		logx(1, "%s: failed to open audio device", d->path);
 		return 0;
@@ -878,6 +1910,10 @@ dev_open(struct dev *d)
 	if (!dev_allocbufs(d))
 		return 0;
 
+	memset(d->hist, 0, sizeof(d->hist));
+	d->ncycles = 0;
+	d->cycle_ns = d->cycle_max = 0;
+	d->nxrun = 0;
 	d->pstate = DEV_INIT;
 	return 1;
 }
@@ -889,19 +1925,20 @@ void
 dev_abort(struct dev *d)
 {
 	int i;
-	struct slot *s;
+	struct slot *s, *snext;
 	struct ctlslot *c;
 	struct opt *o;
 
-	for (i = 0, s = slot_array; i < DEV_NSLOT; i++, s++) {
+	for (s = slot_inuse_list; s != NULL; s = snext) {
+		snext = s->pool_next;
 		if (s->opt == NULL || s->opt->dev != d)
 			continue;
-		if (s->ops) {
-			s->ops->exit(s->arg);
-			s->ops = NULL;
-		}
+		s->ops->exit(s->arg);
+		if (s->ops != NULL)
+			slot_put(s);
 	}
 	d->slot_list = NULL;
+	dev_mix_resetvol(d);
 
 	for (o = opt_list; o != NULL; o = o->next) {
 		if (o->dev != d)
@@ -934,14 +1971,20 @@ dev_freebufs(struct dev *d)
 #endif
 	if (d->mode & MODE_PLAY) {
 		if (d->encbuf != NULL)
-			xfree(d->encbuf);
-		xfree(d->pbuf);
+			xbuf_put(d->encbuf);
+		xbuf_put(d->pbuf);
 	}
 	if (d->mode & MODE_REC) {
 		if (d->decbuf != NULL)
-			xfree(d->decbuf);
-		xfree(d->rbuf);
+			xbuf_put(d->decbuf);
+		xbuf_put(d->rbuf);
+	}
+#ifdef USE_THREADS
+	if (d->job != NULL) {
+		xfree(d->job);
+		d->job = NULL;
 	}
+#endif
 }
 
 /*
@@ -951,6 +1994,7 @@ void
 dev_close(struct dev *d)
 {
 	d->pstate = DEV_CFG;
+	d->reqround = 0;
 	dev_sio_close(d);
 	dev_freebufs(d);
 
@@ -1052,6 +2096,85 @@ dev_roundof(struct dev *d, unsigned int newrate)
 	return (d->round * newrate + d->rate / 2) / d->rate;
 }
 
+/*
+ * Reopen the stopped device with the given block size. Only the audio
+ * device is reopened, the control device and the controls are kept.
+ * If the device can't be reopened with the new block size, it's
+ * reopened with the old one. Return 0 if this fails as well: the
+ * device is left closed, as after a disconnection.
+ */
+int
+dev_reopen(struct dev *d, unsigned int round)
+{
+	unsigned int oldround;
+
+	logx(2, "%s: reopening with %u frame blocks", d->path, round);
+	oldround = d->reqround;
+	dev_freebufs(d);
+	d->reqround = round;
+	dev_initpar(d);
+	if (!dev_sio_reopen(d)) {
+		logx(1, "%s: %u frame blocks not supported", d->path, round);
+		d->reqround = oldround;
+		dev_initpar(d);
+		if (!dev_sio_open(d)) {
+			d->pstate = DEV_CFG;
+			d->reqround = 0;
+			if (d->master_enabled) {
+				d->master_enabled = 0;
+				ctl_del(CTL_DEV_MASTER, d, NULL);
+			}
+			return 0;
+		}
+	}
+	return dev_allocbufs(d);
+}
+
+/*
+ * Return true if a slot other than the given one uses the device
+ */
+int
+dev_inuse(struct dev *d, struct slot *s)
+{
+	struct slot *i;
+
+	for (i = slot_inuse_list; i != NULL; i = i->pool_next) {
+		if (i != s && i->opt != NULL && i->opt->dev == d)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Use the given block size, in frames at the device rate, or keep the
+ * current one if 0. The device is reopened only if the given slot is
+ * the only one using it, because other clients already use the current
+ * block size. The block size never exceeds the default one, so the
+ * device runs with large blocks unless a latency-sensitive client is
+ * alone using it; the default one is restored once the device is idle.
+ * Return 0 if the device couldn't be reopened: the caller must drop
+ * the slot.
+ */
+int
+dev_setround(struct dev *d, struct slot *s, unsigned int round)
+{
+	if (round == 0)
+		return 1;
+	if (round > dev_round)
+		round = dev_round;
+	else if (round < DEV_ROUNDMIN)
+		round = (dev_round < DEV_ROUNDMIN) ? dev_round : DEV_ROUNDMIN;
+
+	if (round == d->reqround || d->pstate != DEV_INIT ||
+	    s->opt->mtc != NULL || dev_inuse(d, s))
+		return 1;
+	if (!dev_reopen(d, round))
+		return 0;
+	s->round = dev_roundof(d, s->rate);
+	s->appbufsz = d->bufsz / d->round * s->round;
+	return 1;
+}
+
 /*
  * If the device is paused, then resume it.
  */
@@ -1123,7 +2246,6 @@ dev_migrate(struct dev *odev)
 void
 mtc_trigger(struct mtc *mtc)
 {
-	int i;
 	struct slot *s;
 
 	if (mtc->tstate != MTC_START) {
@@ -1131,12 +2253,12 @@ mtc_trigger(struct mtc *mtc)
 		return;
 	}
 
-	for (i = 0, s = slot_array; i < DEV_NSLOT; i++, s++) {
+	for (s = slot_inuse_list; s != NULL; s = s->pool_next) {
 		if (s->opt == NULL || s->opt->mtc != mtc)
 			continue;
 		if (s->pstate != SLOT_READY) {
 #ifdef DEBUG
-			logx(3, "slot%zu: not ready, start delayed", s - slot_array);
+			logx(3, "slot%u: not ready, start delayed", s->num);
 #endif
 			return;
 		}
@@ -1144,7 +2266,7 @@ mtc_trigger(struct mtc *mtc)
 	if (!dev_ref(mtc->dev))
 		return;
 
-	for (i = 0, s = slot_array; i < DEV_NSLOT; i++, s++) {
+	for (s = slot_inuse_list; s != NULL; s = s->pool_next) {
 		if (s->opt == NULL || s->opt->mtc != mtc)
 			continue;
 		slot_attach(s);
@@ -1251,32 +2373,36 @@ slot_initconv(struct slot *s)
 	struct dev *d = s->opt->dev;
 
 	if (s->mode & MODE_PLAY) {
-		cmap_init(&s->mix.cmap,
-		    s->opt->pmin, s->opt->pmin + s->mix.nch - 1,
-		    s->opt->pmin, s->opt->pmin + s->mix.nch - 1,
-		    0, d->pchan - 1,
-		    s->opt->pmin, s->opt->pmax,
-		    s->opt->dup);
-		s->mix.decbuf = NULL;
-		s->mix.resampbuf = NULL;
-		if (!aparams_native(&s->par)) {
-			dec_init(&s->mix.dec, &s->par, s->mix.nch);
-			s->mix.decbuf =
-			    xmalloc(s->round * s->mix.nch * sizeof(adata_t));
-		}
 		if (s->rate != d->rate) {
-			resamp_init(&s->mix.resamp, s->round, d->round,
-			    s->mix.nch);
-			s->mix.resampbuf =
-			    xmalloc(d->round * s->mix.nch * sizeof(adata_t));
+			/*
+			 * the group maps channels, the slot only
+			 * applies the volume
+			 */
+			s->mix.grp = dev_mixgrp_ref(d, s);
+		} else {
+			s->mix.grp = NULL;
+			cmap_init(&s->mix.cmap,
+			    s->opt->pmin, s->opt->pmin + s->mix.nch - 1,
+			    s->opt->pmin, s->opt->pmin + s->mix.nch - 1,
+			    0, d->pchan - 1,
+			    s->opt->pmin, s->opt->pmax,
+			    s->opt->dup);
+		}
+		s->mix.decoding = !aparams_native(&s->par);
+		if (s->mix.decoding)
+			dec_init(&s->mix.dec, &s->par, s->mix.nch);
+#ifdef USE_THREADS
+		s->mix.queued = 0;
+		s->mix.decoded = 0;
+		s->mix.decbuf = NULL;
+		if (worker_count > 0 && s->mix.decoding && s->mix.grp == NULL) {
+			s->mix.decbuf = xbuf_get(s->round *
+			    s->mix.nch * sizeof(adata_t));
 		}
+#endif
 	}
 
 	if (s->mode & MODE_RECMASK) {
-
-		s->sub.encbuf = NULL;
-		s->sub.resampbuf = NULL;
-
 		cmap_init(&s->sub.cmap_rec,
 		    0, d->rchan - 1,
 		    s->opt->rmin, s->opt->rmax,
@@ -1291,17 +2417,17 @@ slot_initconv(struct slot *s)
 		    s->opt->pmin, s->opt->pmin + s->sub.nch - 1,
 		    s->opt->dup);
 
-		if (s->rate != d->rate) {
-			resamp_init(&s->sub.resamp, d->round, s->round,
-			    s->sub.nch);
-			s->sub.resampbuf =
-			    xmalloc(d->round * s->sub.nch * sizeof(adata_t));
-		}
-		if (!aparams_native(&s->par)) {
+		s->sub.resampling = (s->rate != d->rate);
+		s->sub.encoding = !aparams_native(&s->par);
+		if (s->sub.encoding)
 			enc_init(&s->sub.enc, &s->par, s->sub.nch);
-			s->sub.encbuf =
-			    xmalloc(s->round * s->sub.nch * sizeof(adata_t));
-		}
+		if (s->sub.resampling || s->sub.encoding)
+			s->sub.grp = dev_subgrp_ref(d, s);
+		else
+			s->sub.grp = NULL;
+#ifdef USE_THREADS
+		s->sub.queued = 0;
+#endif
 
 		/*
 		 * cmap_do() doesn't write samples in all channels,
@@ -1309,19 +2435,39 @@ slot_initconv(struct slot *s)
 	         * disabled. So we have to prefill cmap_do() output
 	         * with silence.
 	         */
-		if (s->sub.resampbuf) {
-			memset(s->sub.resampbuf, 0,
-			    d->round * s->sub.nch * sizeof(adata_t));
-		} else if (s->sub.encbuf) {
-			memset(s->sub.encbuf, 0,
-			    s->round * s->sub.nch * sizeof(adata_t));
-		} else {
+		if (!s->sub.resampling && !s->sub.encoding) {
 			memset(s->sub.buf.data, 0,
 			    s->appbufsz * s->sub.nch * sizeof(adata_t));
 		}
 	}
 }
 
+/*
+ * free conversion chain
+ */
+void
+slot_doneconv(struct slot *s)
+{
+	struct dev *d = s->opt->dev;
+
+	if ((s->mode & MODE_RECMASK) && s->sub.grp != NULL) {
+		dev_subgrp_unref(d, s->sub.grp);
+		s->sub.grp = NULL;
+	}
+
+	if ((s->mode & MODE_PLAY) && s->mix.grp != NULL) {
+		dev_mixgrp_unref(d, s->mix.grp);
+		s->mix.grp = NULL;
+	}
+
+#ifdef USE_THREADS
+	if ((s->mode & MODE_PLAY) && s->mix.decbuf != NULL) {
+		xbuf_put(s->mix.decbuf);
+		s->mix.decbuf = NULL;
+	}
+#endif
+}
+
 /*
  * allocate buffers & conversion chain
  */
@@ -1331,16 +2477,20 @@ slot_allocbufs(struct slot *s)
 	if (s->mode & MODE_PLAY) {
 		s->mix.bpf = s->par.bps * s->mix.nch;
 		abuf_init(&s->mix.buf, s->appbufsz * s->mix.bpf);
+		if (dev_rtprio > 0)
+			memset(s->mix.buf.data, 0, s->mix.buf.len);
 	}
 
 	if (s->mode & MODE_RECMASK) {
 		s->sub.bpf = s->par.bps * s->sub.nch;
 		abuf_init(&s->sub.buf, s->appbufsz * s->sub.bpf);
+		if (dev_rtprio > 0)
+			memset(s->sub.buf.data, 0, s->sub.buf.len);
 	}
 
 #ifdef DEBUG
-	logx(3, "slot%zu: allocated %u/%u fr buffers",
-	    s - slot_array, s->appbufsz, SLOT_BUFSZ(s));
+	logx(3, "slot%u: allocated %u/%u fr buffers",
+	    s->num, s->appbufsz, SLOT_BUFSZ(s));
 #endif
 }
 
@@ -1359,6 +2509,45 @@ slot_freebufs(struct slot *s)
 	}
 }
 
+/*
+ * take a slot from the free list, or allocate a new one
+ */
+struct slot *
+slot_get(void)
+{
+	struct slot *s;
+
+	s = slot_free_list;
+	if (s != NULL)
+		slot_free_list = s->pool_next;
+	else {
+		s = xmalloc(sizeof(struct slot));
+		memset(s, 0, sizeof(struct slot));
+		s->num = slot_count++;
+	}
+	s->pool_next = slot_inuse_list;
+	if (s->pool_next != NULL)
+		s->pool_next->pool_prev = &s->pool_next;
+	s->pool_prev = &slot_inuse_list;
+	slot_inuse_list = s;
+	return s;
+}
+
+/*
+ * mark the slot as unused and put it on the free list
+ */
+void
+slot_put(struct slot *s)
+{
+	s->ops = NULL;
+	*s->pool_prev = s->pool_next;
+	if (s->pool_next != NULL)
+		s->pool_next->pool_prev = s->pool_prev;
+	s->pool_next = slot_free_list;
+	s->pool_prev = NULL;
+	slot_free_list = s;
+}
+
 /*
  * allocate a new slot and register the given call-backs
  */
@@ -1368,20 +2557,12 @@ slot_new(struct opt *opt, unsigned int id, char *who,
 {
 	struct app *a;
 	struct slot *s;
-	int i;
 
 	a = opt_mkapp(opt, who);
 	if (a == NULL)
 		return NULL;
 
-	/*
-	 * find a free slot and assign it the smallest possible unit number
-	 */
-	for (i = 0, s = slot_array; i < DEV_NSLOT; i++, s++) {
-		if (s->ops == NULL)
-			break;
-	}
-	if (i == DEV_NSLOT) {
+	if (slot_free_list == NULL && slot_count == slot_max) {
 		logx(1, "%s: too many connections", a->name);
 		return NULL;
 	}
@@ -1389,12 +2570,18 @@ slot_new(struct opt *opt, unsigned int id, char *who,
 	if (!opt_ref(opt))
 		return NULL;
 
+	s = slot_get();
+
 	s->app = a;
 	s->opt = opt;
 	s->ops = ops;
 	s->arg = arg;
 	s->pstate = SLOT_INIT;
 	s->mode = mode;
+#ifdef USE_THREADS
+	s->nevq = 0;
+	memset(s->pend, 0, sizeof(s->pend));
+#endif
 	aparams_init(&s->par);
 	if (s->mode & MODE_PLAY)
 		s->mix.nch = s->opt->pmax - s->opt->pmin + 1;
@@ -1404,8 +2591,11 @@ slot_new(struct opt *opt, unsigned int id, char *who,
 	s->appbufsz = s->opt->dev->bufsz;
 	s->round = s->opt->dev->round;
 	s->rate = s->opt->dev->rate;
+	s->ncycles = 0;
+	s->play_ns = s->rec_ns = 0;
+	s->nxrun = 0;
 #ifdef DEBUG
-	logx(3, "slot%zu: %s/%s", s - slot_array, s->opt->name, s->app->name);
+	logx(3, "slot%u: %s/%s", s->num, s->opt->name, s->app->name);
 #endif
 	return s;
 }
@@ -1420,7 +2610,7 @@ slot_del(struct slot *s)
 	s->ops = &zomb_slotops;
 	switch (s->pstate) {
 	case SLOT_INIT:
-		s->ops = NULL;
+		slot_put(s);
 		break;
 	case SLOT_START:
 	case SLOT_READY:
@@ -1442,7 +2632,7 @@ slot_setvol(struct slot *s, unsigned int vol)
 	struct app *a = s->app;
 
 #ifdef DEBUG
-	logx(3, "slot%zu: setting volume %u", s - slot_array, vol);
+	logx(3, "slot%u: setting volume %u", s->num, vol);
 #endif
 	if (a->vol != vol) {
 		opt_appvol(o, a, vol);
@@ -1484,8 +2674,8 @@ slot_attach(struct slot *s)
 	}
 
 #ifdef DEBUG
-	logx(2, "slot%zu: attached at %d + %d / %d",
-	    s - slot_array, s->delta, s->delta_rem, s->round);
+	logx(2, "slot%u: attached at %d + %d / %d",
+	    s->num, s->delta, s->delta_rem, s->round);
 #endif
 
 	/*
@@ -1498,7 +2688,7 @@ slot_attach(struct slot *s)
 	d->slot_list = s;
 	if (s->mode & MODE_PLAY) {
 		s->mix.vol = MIDI_TO_ADATA(s->app->vol);
-		dev_mix_adjvol(d);
+		dev_mix_adjvol(d, s, 1);
 	}
 }
 
@@ -1534,12 +2724,12 @@ slot_start(struct slot *s)
 	char enc_str[ENCMAX], chans_str[64];
 
 	if (s->pstate != SLOT_INIT) {
-		logx(0, "slot%zu: slot_start: wrong state", s - slot_array);
+		logx(0, "slot%u: slot_start: wrong state", s->num);
 		panic();
 	}
 
-	logx(2, "slot%zu: %dHz, %s, %s, %d blocks of %d frames",
-	    s - slot_array, s->rate,
+	logx(2, "slot%u: %dHz, %s, %s, %d blocks of %d frames",
+	    s->num, s->rate,
 	    (aparams_enctostr(&s->par, enc_str), enc_str),
 	    (chans_fmt(chans_str, sizeof(chans_str), s->mode,
 	    s->opt->pmin, s->opt->pmin + s->mix.nch - 1,
@@ -1585,7 +2775,7 @@ slot_detach(struct slot *s)
 	for (ps = &d->slot_list; *ps != s; ps = &(*ps)->next) {
 #ifdef DEBUG
 		if (*ps == NULL) {
-			logx(0, "slot%zu: can't detach, not on list", s - slot_array);
+			logx(0, "slot%u: can't detach, not on list", s->num);
 			panic();
 		}
 #endif
@@ -1607,33 +2797,20 @@ slot_detach(struct slot *s)
 	}
 
 #ifdef DEBUG
-	logx(2, "slot%zu: detached at %d + %d / %d",
-	    s - slot_array, s->delta, s->delta_rem, d->round);
+	logx(2, "slot%u: detached at %d + %d / %d",
+	    s->num, s->delta, s->delta_rem, d->round);
 #endif
 	if (s->mode & MODE_PLAY)
-		dev_mix_adjvol(d);
-
-	if (s->mode & MODE_RECMASK) {
-		if (s->sub.encbuf) {
-			xfree(s->sub.encbuf);
-			s->sub.encbuf = NULL;
-		}
-		if (s->sub.resampbuf) {
-			xfree(s->sub.resampbuf);
-			s->sub.resampbuf = NULL;
-		}
-	}
+		dev_mix_adjvol(d, s, -1);
 
-	if (s->mode & MODE_PLAY) {
-		if (s->mix.decbuf) {
-			xfree(s->mix.decbuf);
-			s->mix.decbuf = NULL;
-		}
-		if (s->mix.resampbuf) {
-			xfree(s->mix.resampbuf);
-			s->mix.resampbuf = NULL;
-		}
-	}
+	slot_doneconv(s);
+#ifdef USE_THREADS
+	/*
+	 * the client doesn't expect notifications anymore
+	 */
+	s->nevq = 0;
+	memset(s->pend, 0, sizeof(s->pend));
+#endif
 }
 
 /*
@@ -1644,7 +2821,7 @@ void
 slot_stop(struct slot *s, int drain)
 {
 #ifdef DEBUG
-	logx(3, "slot%zu: stopping (drain = %d)", s - slot_array, drain);
+	logx(3, "slot%u: stopping (drain = %d)", s->num, drain);
 #endif
 	if (s->pstate == SLOT_START) {
 		/*
@@ -1670,7 +2847,7 @@ slot_stop(struct slot *s, int drain)
 		slot_detach(s);
 	} else {
 #ifdef DEBUG
-		logx(3, "slot%zu: not drained (blocked by mmc)", s - slot_array);
+		logx(3, "slot%u: not drained (blocked by mmc)", s->num);
 #endif
 	}
 
@@ -1687,7 +2864,7 @@ slot_skip_update(struct slot *s)
 	skip = slot_skip(s);
 	while (skip > 0) {
 #ifdef DEBUG
-		logx(4, "slot%zu: catching skipped block", s - slot_array);
+		logx(4, "slot%u: catching skipped block", s->num);
 #endif
 		if (s->mode & MODE_RECMASK)
 			s->ops->flush(s->arg);
@@ -1704,9 +2881,10 @@ slot_skip_update(struct slot *s)
 void
 slot_write(struct slot *s)
 {
-	if (s->pstate == SLOT_START && s->mix.buf.used == s->mix.buf.len) {
+	if (s->pstate == SLOT_START &&
+	    abuf_used(&s->mix.buf) == s->mix.buf.len) {
 #ifdef DEBUG
-		logx(4, "slot%zu: switching to READY state", s - slot_array);
+		logx(4, "slot%u: switching to READY state", s->num);
 #endif
 		s->pstate = SLOT_READY;
 		slot_ready(s);
@@ -1939,7 +3117,11 @@ ctl_setval(struct ctl *c, int val)
 		logx(3, "ctl%u: marked as dirty", c->addr);
 		c->curval = val;
 		c->dirty = 1;
-		return dev_ref(c->u.hw.dev);
+		if (!dev_ref(c->u.hw.dev))
+			return 0;
+		if (c->u.hw.dev->sioctl.hdl)
+			file_update(c->u.hw.dev->sioctl.file);
+		return 1;
 	case CTL_DEV_MASTER:
 		if (!c->u.dev_master.dev->master_enabled)
 			return 1;
@@ -1947,12 +3129,14 @@ ctl_setval(struct ctl *c, int val)
 		dev_midi_master(c->u.dev_master.dev);
 		c->val_mask = ~0U;
 		c->curval = val;
+		ctl_notify();
 		return 1;
 	case CTL_APP_LEVEL:
 		opt_appvol(c->u.app_level.opt, c->u.app_level.app, val);
 		opt_midi_vol(c->u.app_level.opt, c->u.app_level.app);
 		c->val_mask = ~0U;
 		c->curval = val;
+		ctl_notify();
 		return 1;
 	case CTL_OPT_DEV:
 		if (opt_setdev(c->u.opt_dev.opt, c->u.opt_dev.dev)) {
@@ -1964,17 +3148,20 @@ ctl_setval(struct ctl *c, int val)
 		opt_setmode(c->u.opt_mode.opt, c->u.opt_mode.idx, val);
 		c->val_mask = ~0U;
 		c->curval = val;
+		ctl_notify();
 		return 1;
 	case CTL_MIDI_PORT:
 		if (midithru_setport(c->u.midi.midithru, c->u.midi.port, val)) {
 			c->val_mask = ~0U;
 			c->curval = val;
+			ctl_notify();
 		}
 		return 1;
 	case CTL_MIDI_THRU:
 		if (midithru_setthru(c->u.midi.midithru, val)) {
 			c->val_mask = ~0U;
 			c->curval = val;
+			ctl_notify();
 		}
 		return 1;
 	default:
@@ -1983,6 +3170,22 @@ ctl_setval(struct ctl *c, int val)
 	}
 }
 
+/*
+ * tell control clients that descriptions or values changed, i.e. that
+ * the desc_mask or val_mask of some controls were set
+ */
+void
+ctl_notify(void)
+{
+	struct ctlslot *s;
+	int i;
+
+	for (s = ctlslot_array, i = 0; i < DEV_NCTLSLOT; i++, s++) {
+		if (s->ops != NULL)
+			s->ops->onctl(s->arg);
+	}
+}
+
 /*
  * add a ctl
  */
@@ -2055,6 +3258,7 @@ ctl_new(int scope, void *arg0, void *arg1,
 	}
 	c->next = *pc;
 	*pc = c;
+	ctl_notify();
 #ifdef DEBUG
 	logx(2, "ctl%u: %s = %d at %s: added", c->addr,
 	    (ctl_fmt(ctl_str, sizeof(ctl_str), c), ctl_str), c->curval,
@@ -2135,6 +3339,7 @@ ctl_onval(int scope, void *arg0, void *arg1, int val)
 		return 0;
 	c->curval = val;
 	c->val_mask = ~0U;
+	ctl_notify();
 	return 1;
 }
 
@@ -2167,6 +3372,7 @@ ctl_del(int scope, void *arg0, void *arg1)
 			}
 			c->type = CTL_NONE;
 			c->desc_mask = ~0;
+			ctl_notify();
 		}
 		pc = &c->next;
 	}
@@ -2234,6 +3440,7 @@ dev_ctlsync(struct dev *d)
 			continue;
 		strlcpy(c->display, display, CTL_DISPLAYMAX);
 		c->desc_mask = ~0;
+		ctl_notify();
 	}
 
 	for (s = ctlslot_array, i = 0; i < DEV_NCTLSLOT; i++, s++) {
@@ -24,15 +24,91 @@
 #include "opt.h"
 
 /*
- * preallocated audio clients
+ * default and upper bound of the max number of audio clients,
+ * allocated as needed
  */
 #define DEV_NSLOT	32
+#define SLOT_NMAX	1024
+
+/*
+ * smallest device block size clients may request
+ */
+#define DEV_ROUNDMIN	32
 
 /*
  * preallocated control clients
  */
 #define DEV_NCTLSLOT 8
 
+/*
+ * max samples processed at once by each stage of the slot conversion
+ * chains, small enough for the tile buffers to stay in the cache
+ */
+#define DEV_TILESZ	1024
+
+/*
+ * playback streams having the same rate and channel range are mixed
+ * together at their common rate, then the sum is resampled at once
+ */
+struct mixgrp {
+	struct mixgrp *next;			/* next on the dev list */
+	int refs;				/* number of slots using it */
+	int rate;				/* slot-side sample rate */
+	int round;				/* slot-side block size */
+	int nch;				/* number of play chans */
+	int pmin, pmax;				/* device channel range */
+	unsigned long long ncycles;		/* blocks resampled */
+	long long resamp_ns;			/* time spent resampling */
+	int dup;				/* true if join/expand enabled */
+	int nmix;				/* slots mixed in this cycle */
+	int nsil;				/* silent slots in this cycle */
+	int nzero;				/* zero frames in resamp ctx */
+	int stale;				/* resamp ctx not up to date */
+	adata_t *buf;				/* sum of slot blocks */
+	struct resamp resamp;			/* resampler state */
+	struct cmap cmap;			/* channel mapper state */
+#ifdef USE_THREADS
+	int queued;				/* job queued in this cycle */
+	adata_t *out;				/* resampled sum */
+#endif
+};
+
+/*
+ * recording streams of the same opt with the same parameters share
+ * the conversion chain, it's run once per cycle and the result is
+ * copied to each stream
+ */
+struct subgrp {
+	struct subgrp *next;			/* next on the dev list */
+	int refs;				/* number of slots using it */
+	struct opt *opt;			/* config used */
+	struct aparams par;			/* slot-side params */
+	int rate;				/* slot-side sample rate */
+	int nch;				/* number of rec chans */
+	int ready;				/* buf has the current block */
+	unsigned char *buf;			/* converted block */
+	struct resamp resamp;			/* resampler state */
+#ifdef USE_THREADS
+	int queued;				/* job queued in this cycle */
+#endif
+};
+
+#ifdef USE_THREADS
+/*
+ * conversions of a cycle are split into independent jobs, run in
+ * parallel by the worker threads; results are then mixed in the
+ * same order as in the single-threaded case
+ */
+struct dev_job {
+#define DEV_JOB_DEC	0			/* decode a play block */
+#define DEV_JOB_MIXGRP	1			/* mix & resample a group */
+#define DEV_JOB_SUB	2			/* convert a rec block */
+#define DEV_JOB_SUBGRP	3			/* convert a rec group */
+	int type;
+	void *ptr;				/* slot or group */
+};
+#endif
+
 /*
  * audio stream state structure
  */
@@ -48,30 +124,51 @@ struct slotops
 	void (*exit)(void *);			/* delete client */
 };
 
+/*
+ * slot events
+ */
+#define SLOT_MOVE	0			/* onmove() */
+#define SLOT_XRUN	1			/* onxrun() */
+#define SLOT_FLUSH	2			/* flush() */
+#define SLOT_FILL	3			/* fill() */
+#define SLOT_EOF	4			/* eof() */
+#define SLOT_EXIT	5			/* exit() */
+#define SLOT_NEV	6			/* number of events */
+#define SLOT_NEVQ	32			/* max events queued in order */
+
 struct ctlops
 {
 	void (*exit)(void *);			/* delete client */
 	void (*sync)(void *);			/* description ready */
+	void (*onctl)(void *);			/* controls changed */
 };
 
 struct slot {
 	struct slotops *ops;			/* client callbacks */
 	struct slot *next;			/* next on the play list */
+	struct slot *pool_next;			/* next used or free slot */
+	struct slot **pool_prev;		/* previous used slot's next */
+	unsigned int num;			/* slot number */
 	struct opt *opt;			/* config used */
 	void *arg;				/* user data for callbacks */
 	struct aparams par;			/* socket side params */
 	struct {
-		int weight;			/* dynamic range */
 		unsigned int vol;		/* volume within the vol */
 		struct abuf buf;		/* socket side buffer */
 		int bpf;			/* byte per frame */
 		int nch;			/* number of play chans */
 		struct cmap cmap;		/* channel mapper state */
-		struct resamp resamp;		/* resampler state */
 		struct conv dec;		/* format decoder params */
 		int join;			/* channel join factor */
 		int expand;			/* channel expand factor */
-		void *resampbuf, *decbuf;	/* tmp buffers */
+		struct mixgrp *grp;		/* group to resample with */
+		int decoding;			/* format conversion needed */
+		int silent;			/* current block is silence */
+#ifdef USE_THREADS
+		int queued;			/* job queued in this cycle */
+		int decoded;			/* decbuf has the block */
+		adata_t *decbuf;		/* decoded block */
+#endif
 	} mix;
 	struct {
 		struct abuf buf;		/* socket side buffer */
@@ -80,9 +177,13 @@ struct slot {
 		int nch;			/* number of rec chans */
 		struct cmap cmap_rec;		/* rec channel mapper state */
 		struct cmap cmap_mon;		/* mon channel mapper state */
-		struct resamp resamp;		/* buffer for resampling */
 		struct conv enc;		/* buffer for encoding */
-		void *resampbuf, *encbuf;	/* tmp buffers */
+		int resampling;			/* rate conversion needed */
+		int encoding;			/* format conversion needed */
+		struct subgrp *grp;		/* group to convert with */
+#ifdef USE_THREADS
+		int queued;			/* job queued in this cycle */
+#endif
 	} sub;
 	int xrun;				/* underrun policy */
 	int skip;				/* cycles to skip (for xrun) */
@@ -91,6 +192,14 @@ struct slot {
 	int appbufsz;				/* slot-side buffer size */
 	int round;				/* slot-side block size */
 	int rate;				/* slot-side sample rate */
+#ifdef USE_THREADS
+	struct {
+		unsigned int ev;		/* one of SLOT_xxx */
+		unsigned int n;			/* number of occurrences */
+	} evq[SLOT_NEVQ];			/* queued by the dev thread */
+	unsigned int nevq;			/* entries in evq */
+	unsigned int pend[SLOT_NEV];		/* queued once evq is full */
+#endif
 	int delta;				/* pending clock ticks */
 	int delta_rem;				/* remainder for delta */
 	int mode;				/* MODE_{PLAY,REC} */
@@ -102,6 +211,13 @@ struct slot {
 	int pstate;
 	int paused;				/* paused because of xrun */
 
+	/*
+	 * processing cost, see dev_logstats()
+	 */
+	unsigned long long ncycles;		/* blocks processed */
+	long long play_ns, rec_ns;		/* time spent converting */
+	unsigned int nxrun;			/* number of xruns */
+
 	struct app *app;
 };
 
@@ -221,6 +337,28 @@ struct mtc {
 struct dev {
 	struct dev *next;
 	struct slot *slot_list;			/* audio streams attached */
+	struct mixgrp *mixgrp_list;		/* groups of resampled streams */
+
+	/*
+	 * number of attached play slots and, for each channel, the
+	 * number of them with channel ranges below it or above it
+	 */
+	int mix_nslot;
+	int mix_nbelow[NCHAN_MAX];
+	int mix_nabove[NCHAN_MAX];
+
+	struct subgrp *subgrp_list;		/* groups of converted streams */
+
+	/*
+	 * histogram of dev_cycle() durations, bin i counts the cycles
+	 * that took less than 1/2^(DEV_NHIST - 2 - i) of the block
+	 * period, the last bin counts the ones that took longer
+	 */
+#define DEV_NHIST	8
+	unsigned long long hist[DEV_NHIST];
+	unsigned long long ncycles;		/* full cycles */
+	long long cycle_ns, cycle_max;		/* total and max durations */
+	unsigned int nxrun;			/* device xruns */
 
 	/*
 	 * name used for various controls
@@ -243,6 +381,11 @@ struct dev {
 	struct conv dec;			/* device->native format */
 	unsigned char *encbuf;			/* buffer for encoding */
 	unsigned char *decbuf;			/* buffer for decoding */
+	adata_t tilebuf[2][DEV_TILESZ];		/* slot conversion tiles */
+#ifdef USE_THREADS
+	struct dev_job *job;			/* jobs of the cycle */
+	int njobs;				/* number of jobs */
+#endif
 
 	/*
 	 * current position, relative to the current cycle
@@ -254,8 +397,10 @@ struct dev {
 	 */
 	struct aparams reqpar;			/* parameters */
 	int reqpchan, reqrchan;			/* play & rec chans */
+	unsigned int reqround;			/* block size, 0 = default */
 	unsigned int hold;			/* hold the device open ? */
 	unsigned int autovol;			/* auto adjust playvol ? */
+	unsigned int thread;			/* run in its own thread ? */
 	unsigned int refcnt;			/* number of openers */
 #define DEV_NMAX	16			/* max number of devices */
 	unsigned int num;			/* device serial number */
@@ -272,6 +417,7 @@ struct dev {
 	unsigned int bufsz, round, rate;
 	unsigned int prime;
 	unsigned int idle;			/* cycles with no client */
+	unsigned int excl;			/* mixer bypassed last cycle */
 
 	unsigned int master;			/* software vol. knob */
 	unsigned int master_enabled;		/* 1 if h/w has no vo. knob */
@@ -279,17 +425,20 @@ struct dev {
 
 extern struct dev *dev_list;
 extern struct ctl *ctl_list;
-extern struct slot slot_array[DEV_NSLOT];
+extern struct slot *slot_inuse_list, *slot_free_list;
+extern unsigned int slot_count, slot_max;
 extern struct ctlslot ctlslot_array[DEV_NCTLSLOT];
 extern struct mtc mtc_array[1];
 extern int dev_rate, dev_bufsz, dev_round;
+extern int dev_rtprio;
 
 size_t chans_fmt(char *, size_t, int, int, int, int, int);
 int dev_open(struct dev *);
 void dev_close(struct dev *);
 void dev_abort(struct dev *);
 void dev_migrate(struct dev *);
-struct dev *dev_new(char *, struct aparams *, unsigned int, unsigned int);
+struct dev *dev_new(char *, struct aparams *, unsigned int, unsigned int,
+    unsigned int);
 struct dev *dev_bynum(int);
 void dev_del(struct dev *);
 void dev_adjpar(struct dev *, int, int);
@@ -298,12 +447,15 @@ void dev_done(struct dev *);
 int dev_ref(struct dev *);
 void dev_unref(struct dev *);
 unsigned int dev_roundof(struct dev *, unsigned int);
+int dev_setround(struct dev *, struct slot *, unsigned int);
+void dev_logstats(struct dev *);
 int dev_iscompat(struct dev *, struct dev *);
 
 /*
  * interface to hardware device
  */
 void dev_onmove(struct dev *, int);
+void dev_notify(struct dev *);
 void dev_cycle(struct dev *);
 
 /*
@@ -327,12 +479,15 @@ void mtc_setdev(struct mtc *, struct dev *);
 struct slot *slot_new(struct opt *, unsigned int, char *,
     struct slotops *, void *, int);
 void slot_del(struct slot *);
+void slot_put(struct slot *);
 void slot_setvol(struct slot *, unsigned int);
 void slot_start(struct slot *);
 void slot_stop(struct slot *, int);
 void slot_read(struct slot *);
 void slot_write(struct slot *);
 void slot_initconv(struct slot *);
+void slot_doneconv(struct slot *);
+void slot_notify(struct slot *, int);
 void slot_attach(struct slot *);
 void slot_detach(struct slot *);
 
@@ -351,6 +506,7 @@ int ctl_match(struct ctl *, int, void *, void *);
 struct ctl *ctl_find(int, void *, void *);
 void ctl_update(struct ctl *);
 int ctl_onval(int, void *, void *, int);
+void ctl_notify(void);
 
 struct ctlslot *ctlslot_new(struct opt *, struct midithru *, struct ctlops *, void *);
 void ctlslot_del(struct ctlslot *);
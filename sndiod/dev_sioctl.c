@@ -95,6 +95,7 @@ dev_sioctl_onval(void *arg, unsigned int addr, unsigned int val)
 
 		c->val_mask = ~0U;
 		c->curval = val;
+		ctl_notify();
 	}
 }
 
@@ -138,6 +139,7 @@ dev_sioctl_close(struct dev *d)
 			}
 			c->type = CTL_NONE;
 			c->desc_mask = ~0;
+			ctl_notify();
 		}
 		pc = &c->next;
 	}
@@ -14,11 +14,38 @@
  * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DSP_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include "dsp.h"
 #include "utils.h"
 
+/*
+ * Kernel templates must be inlined, so the constant arguments of each
+ * specialized version are propagated and the loops unrolled
+ */
+#ifdef __GNUC__
+#define DSP_INLINE	static inline __attribute__((always_inline))
+#else
+#define DSP_INLINE	static inline
+#endif
+
+/*
+ * Number of samples the encoders and decoders process at once in
+ * their inner loops, must be a multiple of the SIMD vector size.
+ */
+#define CONV_BLKSZ	16
+
 const int aparams_ctltovol[128] = {
 	        0,     65536,     68109,     70783,
 	    73562,     76450,     79451,     82570,
@@ -132,7 +159,10 @@ aparams_enctostr(struct aparams *par, char *ostr)
 {
 	char *p = ostr;
 
-	*p++ = par->sig ? 's' : 'u';
+	if (par->flt)
+		*p++ = 'f';
+	else
+		*p++ = par->sig ? 's' : 'u';
 	if (par->bits > 9)
 		*p++ = '0' + par->bits / 10;
 	*p++ = '0' + par->bits % 10;
@@ -162,7 +192,7 @@ int
 aparams_strtoenc(struct aparams *par, char *istr)
 {
 	char *p = istr;
-	int i, sig, bits, le, bps, msb;
+	int i, sig, bits, le, bps, msb, flt;
 
 #define IS_SEP(c)			\
 	(((c) < 'a' || (c) > 'z') &&	\
@@ -170,12 +200,16 @@ aparams_strtoenc(struct aparams *par, char *istr)
 	 ((c) < '0' || (c) > '9'))
 
 	/*
-	 * get signedness
+	 * get signedness, or floating point
 	 */
+	flt = 0;
 	if (*p == 's') {
 		sig = 1;
 	} else if (*p == 'u') {
 		sig = 0;
+	} else if (*p == 'f') {
+		sig = 1;
+		flt = 1;
 	} else
 		return 0;
 	p++;
@@ -192,6 +226,8 @@ aparams_strtoenc(struct aparams *par, char *istr)
 	}
 	if (bits < BITS_MIN || bits > BITS_MAX)
 		return 0;
+	if (flt && bits != 32)
+		return 0;
 	bps = APARAMS_BPS(bits);
 	msb = 1;
 	le = ADATA_LE;
@@ -210,6 +246,15 @@ aparams_strtoenc(struct aparams *par, char *istr)
 	} else
 		return 0;
 
+	/*
+	 * floats have no padding
+	 */
+	if (flt) {
+		if (!IS_SEP(*p))
+			return 0;
+		goto done;
+	}
+
 	/*
 	 * get (optional) number of bytes
 	 */
@@ -237,6 +282,7 @@ aparams_strtoenc(struct aparams *par, char *istr)
 		return 0;
 
 done:
+	par->flt = flt;
 	par->msb = msb;
 	par->sig = sig;
 	par->bits = bits;
@@ -257,6 +303,7 @@ aparams_init(struct aparams *par)
 	par->le = ADATA_LE;
 	par->sig = 1;
 	par->msb = 0;
+	par->flt = 0;
 }
 
 /*
@@ -265,13 +312,141 @@ aparams_init(struct aparams *par)
 int
 aparams_native(struct aparams *par)
 {
-	return par->sig &&
+	return par->sig && !par->flt &&
 	    par->bps == sizeof(adata_t) &&
 	    par->bits == ADATA_BITS &&
 	    (par->bps == 1 || par->le == ADATA_LE) &&
 	    (par->bits == par->bps * 8 || !par->msb);
 }
 
+/*
+ * Return the sum of x[i] * h[i] products for i in 0..n-1. This is the
+ * inner loop of the resampler: x points to the history of a channel
+ * and h to the filter coefficients. As integer arithmetic is exact,
+ * all the variants below return the same result regardless of the
+ * order the products are summed in.
+ */
+static int64_t
+resamp_dot_c(adata_t *x, int *h, int n)
+{
+	int64_t f = 0;
+
+	for (; n > 0; n--)
+		f += (int64_t)*x++ * *h++;
+	return f;
+}
+
+#ifdef DSP_X86
+/*
+ * SSE2 only has the unsigned 32-bit multiply, pmuludq. Use it and
+ * subtract the 2^32 * (x < 0 ? h : 0) + 2^32 * (h < 0 ? x : 0) terms
+ * afterwards. Only the low 32 bits of the correction term matter, so
+ * it's accumulated in 32-bit lanes.
+ */
+__attribute__((target("sse2")))
+static int64_t
+resamp_dot_sse2(adata_t *x, int *h, int n)
+{
+	__m128i vx, vh, acc, corr;
+	int64_t a[2];
+	unsigned int c[4];
+	unsigned long long f;
+
+	acc = _mm_setzero_si128();
+	corr = _mm_setzero_si128();
+	for (; n >= 4; n -= 4) {
+		vx = _mm_loadu_si128((__m128i *)x);
+		vh = _mm_loadu_si128((__m128i *)h);
+		acc = _mm_add_epi64(acc, _mm_mul_epu32(vx, vh));
+		acc = _mm_add_epi64(acc, _mm_mul_epu32(
+		    _mm_srli_epi64(vx, 32), _mm_srli_epi64(vh, 32)));
+		corr = _mm_add_epi32(corr,
+		    _mm_and_si128(vh, _mm_srai_epi32(vx, 31)));
+		corr = _mm_add_epi32(corr,
+		    _mm_and_si128(vx, _mm_srai_epi32(vh, 31)));
+		x += 4;
+		h += 4;
+	}
+	_mm_storeu_si128((__m128i *)a, acc);
+	_mm_storeu_si128((__m128i *)c, corr);
+	f = (unsigned long long)a[0] + (unsigned long long)a[1] -
+	    ((unsigned long long)(c[0] + c[1] + c[2] + c[3]) << 32);
+	return (int64_t)f + resamp_dot_c(x, h, n);
+}
+
+__attribute__((target("avx2")))
+static int64_t
+resamp_dot_avx2(adata_t *x, int *h, int n)
+{
+	__m256i vx, vh, acc;
+	int64_t a[4];
+
+	acc = _mm256_setzero_si256();
+	for (; n >= 8; n -= 8) {
+		vx = _mm256_loadu_si256((__m256i *)x);
+		vh = _mm256_loadu_si256((__m256i *)h);
+		acc = _mm256_add_epi64(acc, _mm256_mul_epi32(vx, vh));
+		acc = _mm256_add_epi64(acc, _mm256_mul_epi32(
+		    _mm256_srli_epi64(vx, 32), _mm256_srli_epi64(vh, 32)));
+		x += 8;
+		h += 8;
+	}
+	_mm256_storeu_si256((__m256i *)a, acc);
+	return a[0] + a[1] + a[2] + a[3] + resamp_dot_c(x, h, n);
+}
+#endif
+
+#ifdef __ARM_NEON
+static int64_t
+resamp_dot_neon(adata_t *x, int *h, int n)
+{
+	int32x4_t vx, vh;
+	int64x2_t acc0, acc1;
+
+	acc0 = vdupq_n_s64(0);
+	acc1 = vdupq_n_s64(0);
+	for (; n >= 4; n -= 4) {
+		vx = vld1q_s32(x);
+		vh = vld1q_s32(h);
+		acc0 = vmlal_s32(acc0, vget_low_s32(vx), vget_low_s32(vh));
+		acc1 = vmlal_s32(acc1, vget_high_s32(vx), vget_high_s32(vh));
+		x += 4;
+		h += 4;
+	}
+	acc0 = vaddq_s64(acc0, acc1);
+	return vgetq_lane_s64(acc0, 0) + vgetq_lane_s64(acc0, 1) +
+	    resamp_dot_c(x, h, n);
+}
+#endif
+
+static int64_t (*resamp_dot)(adata_t *, int *, int) = resamp_dot_c;
+
+/*
+ * Select the fastest kernels the CPU supports, must be called
+ * once at startup.
+ */
+void
+dsp_init(void)
+{
+	char *name = "c";
+
+#ifdef DSP_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		resamp_dot = resamp_dot_avx2;
+		name = "avx2";
+	} else if (__builtin_cpu_supports("sse2")) {
+		resamp_dot = resamp_dot_sse2;
+		name = "sse2";
+	}
+#endif
+#ifdef __ARM_NEON
+	resamp_dot = resamp_dot_neon;
+	name = "neon";
+#endif
+	logx(3, "dsp: using %s kernels", name);
+}
+
 /*
  * Return the number of input and output frame that would be consumed
  * by resamp_do(p, *icnt, *ocnt).
@@ -291,6 +466,29 @@ resamp_getcnt(struct resamp *p, int *icnt, int *ocnt)
 		*icnt = (odiff + p->diff) / p->oblksz;
 }
 
+/*
+ * Interpolate the filter coefficients for the output sample at the
+ * given phase (diff) and return their number.
+ */
+static int
+resamp_mkfilt(struct resamp *p, int diff, int *coef)
+{
+	int q, qi, qf, s, ds, n;
+
+	q = diff * p->filt_step;
+	n = 0;
+	while (q < RESAMP_LENGTH) {
+		qi = q >> RESAMP_STEP_BITS;
+		qf = q & (RESAMP_STEP - 1);
+		s = resamp_filt[qi];
+		ds = resamp_filt[qi + 1] - s;
+		s += (int64_t)qf * ds >> RESAMP_STEP_BITS;
+		coef[n++] = s;
+		q += p->filt_cutoff;
+	}
+	return n;
+}
+
 /*
  * Resample the given number of frames. The number of output frames
  * must match the corresponding number of input frames. Either always
@@ -307,15 +505,16 @@ resamp_do(struct resamp *p, adata_t *in, adata_t *out, int icnt, int ocnt)
 	adata_t *idata;
 	unsigned int oblksz;
 	unsigned int ifr;
-	int s, ds, diff;
+	int s, diff;
 	adata_t *odata;
 	unsigned int iblksz;
 	unsigned int ofr;
 	unsigned int c;
-	int64_t f[NCHAN_MAX];
+	int64_t f;
+	int coefbuf[RESAMP_NCTX], *coef;
 	adata_t *ctxbuf, *ctx;
-	unsigned int ctx_start;
-	int q, qi, qf, n;
+	unsigned int ctx_start, ctx_len;
+	int n;
 
 	/*
 	 * Partially copy structures into local variables, to avoid
@@ -329,6 +528,7 @@ resamp_do(struct resamp *p, adata_t *in, adata_t *out, int icnt, int ocnt)
 	oblksz = p->oblksz;
 	ctxbuf = p->ctx;
 	ctx_start = p->ctx_start;
+	ctx_len = p->ctx_len;
 	nch = p->nch;
 	ifr = icnt;
 	ofr = ocnt;
@@ -343,11 +543,11 @@ resamp_do(struct resamp *p, adata_t *in, adata_t *out, int icnt, int ocnt)
 		if (diff >= oblksz) {
 			if (ifr == 0)
 				break;
-			ctx_start = (ctx_start - 1) & (RESAMP_NCTX - 1);
+			ctx_start = (ctx_start - 1) & (ctx_len - 1);
 			ctx = ctxbuf + ctx_start;
 			for (c = nch; c > 0; c--) {
-				*ctx = *idata++;
-				ctx += RESAMP_NCTX;
+				ctx[0] = ctx[ctx_len] = *idata++;
+				ctx += 2 * ctx_len;
 			}
 			diff -= oblksz;
 			ifr--;
@@ -355,29 +555,23 @@ resamp_do(struct resamp *p, adata_t *in, adata_t *out, int icnt, int ocnt)
 			if (ofr == 0)
 				break;
 
-			for (c = 0; c < nch; c++)
-				f[c] = 0;
-
-			q = diff * p->filt_step;
-			n = ctx_start;
-
-			while (q < RESAMP_LENGTH) {
-				qi = q >> RESAMP_STEP_BITS;
-				qf = q & (RESAMP_STEP - 1);
-				s = resamp_filt[qi];
-				ds = resamp_filt[qi + 1] - s;
-				s += (int64_t)qf * ds >> RESAMP_STEP_BITS;
-				ctx = ctxbuf;
-				for (c = 0; c < nch; c++) {
-					f[c] += (int64_t)ctx[n] * s;
-					ctx += RESAMP_NCTX;
-				}
-				q += p->filt_cutoff;
-				n = (n + 1) & (RESAMP_NCTX - 1);
+			/*
+			 * The filter coefficients depend only on the
+			 * phase, they are the same for all channels.
+			 */
+			if (p->filt) {
+				n = p->filt_ntaps;
+				coef = p->filt + diff * n;
+			} else {
+				n = resamp_mkfilt(p, diff, coefbuf);
+				coef = coefbuf;
 			}
 
+			ctx = ctxbuf + ctx_start;
 			for (c = 0; c < nch; c++) {
-				s = f[c] >> RESAMP_BITS;
+				f = resamp_dot(ctx, coef, n);
+				ctx += 2 * ctx_len;
+				s = f >> RESAMP_BITS;
 				s = (int64_t)s * p->filt_cutoff >> RESAMP_BITS;
 #if ADATA_BITS == 16
 				/*
@@ -414,6 +608,18 @@ resamp_do(struct resamp *p, adata_t *in, adata_t *out, int icnt, int ocnt)
 #endif
 }
 
+/*
+ * Advance the state as resamp_do() would with silent input, without
+ * producing any output. This is only correct if the history contains
+ * only zeros, in which case the output would be silence as well.
+ */
+void
+resamp_skip(struct resamp *p, int icnt, int ocnt)
+{
+	p->ctx_start = (p->ctx_start - icnt) & (p->ctx_len - 1);
+	p->diff += (long long)ocnt * p->iblksz - (long long)icnt * p->oblksz;
+}
+
 static unsigned int
 uint_gcd(unsigned int a, unsigned int b)
 {
@@ -434,7 +640,8 @@ void
 resamp_init(struct resamp *p, unsigned int iblksz,
     unsigned int oblksz, int nch)
 {
-	unsigned int g;
+	unsigned int g, i;
+	int n;
 
 	/*
 	 * reduce iblksz/oblksz fraction
@@ -455,8 +662,6 @@ resamp_init(struct resamp *p, unsigned int iblksz,
 	p->oblksz = oblksz;
 	p->diff = 0;
 	p->nch = nch;
-	p->ctx_start = 0;
-	memset(p->ctx, 0, sizeof(p->ctx));
 	if (p->iblksz < p->oblksz) {
 		p->filt_cutoff = RESAMP_UNIT;
 		p->filt_step = RESAMP_UNIT / p->oblksz;
@@ -464,16 +669,75 @@ resamp_init(struct resamp *p, unsigned int iblksz,
 		p->filt_cutoff = (int64_t)RESAMP_UNIT * p->oblksz / p->iblksz;
 		p->filt_step = RESAMP_UNIT / p->iblksz;
 	}
+
+	/*
+	 * if there are few phases, compute the coefficients of
+	 * each phase once for all; phases with fewer taps are
+	 * padded with zeros, which doesn't change the result
+	 */
+	p->filt = NULL;
+	p->filt_ntaps = (RESAMP_LENGTH + p->filt_cutoff - 1) / p->filt_cutoff;
 #ifdef DEBUG
-	logx(3, "resamp_init: %u/%u", iblksz, oblksz);
+	if (p->filt_ntaps > RESAMP_NCTX) {
+		logx(0, "resamp_init: %u/%u: ratio too large", iblksz, oblksz);
+		panic();
+	}
+#endif
+	if (p->oblksz * p->filt_ntaps <= RESAMP_NFILT) {
+		p->filt = xbuf_get(p->oblksz * p->filt_ntaps * sizeof(int));
+		for (i = 0; i < p->oblksz; i++) {
+			n = resamp_mkfilt(p, i, p->filt + i * p->filt_ntaps);
+			while (n < p->filt_ntaps)
+				p->filt[i * p->filt_ntaps + n++] = 0;
+		}
+	}
+
+	/*
+	 * the history must hold as many frames as the longest
+	 * filter, round it to a power of two for cheap wrapping
+	 */
+	p->ctx_len = 1;
+	while (p->ctx_len < p->filt_ntaps)
+		p->ctx_len <<= 1;
+	p->ctx_start = 0;
+	p->ctx = xbuf_get(nch * 2 * p->ctx_len * sizeof(adata_t));
+	memset(p->ctx, 0, nch * 2 * p->ctx_len * sizeof(adata_t));
+#ifdef DEBUG
+	logx(3, "resamp_init: %u/%u%s", iblksz, oblksz,
+	    p->filt ? ", precomputed" : "");
 #endif
 }
 
 /*
- * encode "todo" frames from native to foreign encoding
+ * drop the resampler history, as if it was just initialized
  */
 void
-enc_do(struct conv *p, unsigned char *in, unsigned char *out, int todo)
+resamp_reset(struct resamp *p)
+{
+	p->diff = 0;
+	p->ctx_start = 0;
+	memset(p->ctx, 0, p->nch * 2 * p->ctx_len * sizeof(adata_t));
+}
+
+/*
+ * free resources allocated by resamp_init()
+ */
+void
+resamp_done(struct resamp *p)
+{
+	if (p->filt) {
+		xbuf_put(p->filt);
+		p->filt = NULL;
+	}
+	xbuf_put(p->ctx);
+	p->ctx = NULL;
+}
+
+/*
+ * encode "todo" frames from native to foreign encoding, any encoding
+ */
+static void
+enc_do_any(struct conv *p, unsigned char *in, unsigned char *out, int todo)
 {
 	unsigned int f;
 	adata_t *idata;
@@ -486,9 +750,6 @@ enc_do(struct conv *p, unsigned char *in, unsigned char *out, int todo)
 	int obnext;
 	int osnext;
 
-#ifdef DEBUG
-	logx(4, "enc: copying %u frames", todo);
-#endif
 	/*
 	 * Partially copy structures into local variables, to avoid
 	 * unnecessary indirections; this also allows the compiler to
@@ -524,6 +785,179 @@ enc_do(struct conv *p, unsigned char *in, unsigned char *out, int todo)
 	}
 }
 
+/*
+ * reverse the byte order of a 32-bit word
+ */
+DSP_INLINE unsigned int
+swap32(unsigned int s)
+{
+	return (s << 24) | ((s & 0xff00) << 8) | ((s >> 8) & 0xff00) | (s >> 24);
+}
+
+/*
+ * convert an adata_t sample to a 16-bit or 32-bit word: this is a
+ * shift, plus a sign flip for unsigned formats and a byte swap for
+ * non-native byte orders
+ */
+DSP_INLINE unsigned int
+enc_word(adata_t a, unsigned int shift, unsigned int bps, int swap, int sig)
+{
+	unsigned int s;
+
+	s = (unsigned int)a << (32 - ADATA_BITS);
+	if (sig)
+		s = (int)s >> shift;
+	else
+		s = (s ^ (1U << 31)) >> shift;
+	if (swap) {
+		if (bps == 2)
+			s = ((s & 0xff) << 8) | ((s >> 8) & 0xff);
+		else
+			s = swap32(s);
+	}
+	return s;
+}
+
+/*
+ * encoder template for 16-bit and 32-bit words. Samples are processed
+ * in fixed size blocks, so the compiler can vectorize the inner loops.
+ */
+DSP_INLINE void
+enc_do_word(struct conv *p, void *restrict in, void *restrict out, int todo,
+    unsigned int bps, int swap, int sig)
+{
+	unsigned int i, n, s, shift;
+	adata_t *idata;
+	unsigned short *odata16;
+	unsigned int *odata32;
+
+	idata = in;
+	odata16 = out;
+	odata32 = out;
+	shift = p->shift;
+	n = todo * p->nch;
+	for (; n >= CONV_BLKSZ; n -= CONV_BLKSZ) {
+		for (i = 0; i < CONV_BLKSZ; i++) {
+			s = enc_word(*idata++, shift, bps, swap, sig);
+			if (bps == 2)
+				*odata16++ = s;
+			else
+				*odata32++ = s;
+		}
+	}
+	for (; n > 0; n--) {
+		s = enc_word(*idata++, shift, bps, swap, sig);
+		if (bps == 2)
+			*odata16++ = s;
+		else
+			*odata32++ = s;
+	}
+}
+
+static void
+enc_do_s16ne(struct conv *p, unsigned char *in, unsigned char *out, int todo)
+{
+	enc_do_word(p, in, out, todo, 2, 0, 1);
+}
+
+static void
+enc_do_u16ne(struct conv *p, unsigned char *in, unsigned char *out, int todo)
+{
+	enc_do_word(p, in, out, todo, 2, 0, 0);
+}
+
+static void
+enc_do_s16sw(struct conv *p, unsigned char *in, unsigned char *out, int todo)
+{
+	enc_do_word(p, in, out, todo, 2, 1, 1);
+}
+
+static void
+enc_do_u16sw(struct conv *p, unsigned char *in, unsigned char *out, int todo)
+{
+	enc_do_word(p, in, out, todo, 2, 1, 0);
+}
+
+static void
+enc_do_s32ne(struct conv *p, unsigned char *in, unsigned char *out, int todo)
+{
+	enc_do_word(p, in, out, todo, 4, 0, 1);
+}
+
+static void
+enc_do_u32ne(struct conv *p, unsigned char *in, unsigned char *out, int todo)
+{
+	enc_do_word(p, in, out, todo, 4, 0, 0);
+}
+
+static void
+enc_do_s32sw(struct conv *p, unsigned char *in, unsigned char *out, int todo)
+{
+	enc_do_word(p, in, out, todo, 4, 1, 1);
+}
+
+static void
+enc_do_u32sw(struct conv *p, unsigned char *in, unsigned char *out, int todo)
+{
+	enc_do_word(p, in, out, todo, 4, 1, 0);
+}
+
+/*
+ * encoder template for 32-bit IEEE 754 floats. As adata_t fits in the
+ * float mantissa, the conversion is exact.
+ */
+DSP_INLINE void
+enc_do_flt(struct conv *p, void *restrict in, void *restrict out, int todo,
+    int swap)
+{
+	unsigned int n;
+	adata_t *idata;
+	unsigned int *odata;
+	union {
+		float f;
+		unsigned int u;
+	} x;
+
+	idata = in;
+	odata = out;
+	for (n = todo * p->nch; n > 0; n--) {
+		x.f = *idata++ * (1.0f / ADATA_UNIT);
+		*odata++ = swap ? swap32(x.u) : x.u;
+	}
+}
+
+static void
+enc_do_f32ne(struct conv *p, unsigned char *in, unsigned char *out, int todo)
+{
+	enc_do_flt(p, in, out, todo, 0);
+}
+
+static void
+enc_do_f32sw(struct conv *p, unsigned char *in, unsigned char *out, int todo)
+{
+	enc_do_flt(p, in, out, todo, 1);
+}
+
+static void (*enc_funcs[])(struct conv *,
+    unsigned char *, unsigned char *, int) = {
+	enc_do_any,
+	enc_do_s16ne, enc_do_u16ne, enc_do_s16sw, enc_do_u16sw,
+	enc_do_s32ne, enc_do_u32ne, enc_do_s32sw, enc_do_u32sw,
+	enc_do_f32ne, enc_do_f32sw
+};
+
+/*
+ * encode "todo" frames from native to foreign encoding
+ */
+void
+enc_do(struct conv *p, unsigned char *in, unsigned char *out, int todo)
+{
+#ifdef DEBUG
+	logx(4, "enc: copying %u frames", todo);
+#endif
+	p->func(p, in, out, todo);
+}
+
 /*
  * store "todo" frames of silence in foreign encoding
  */
@@ -570,6 +1004,63 @@ enc_sil_do(struct conv *p, unsigned char *out, int todo)
 	}
 }
 
+/*
+ * return true if the "todo" bytes are all zero, which is silence in
+ * signed and float encodings. The bytes are or-ed in chunks, so the
+ * loop doesn't branch on each word
+ */
+int
+sil_test(unsigned char *buf, int todo)
+{
+	uint64_t w, acc;
+	int i;
+
+	for (; todo >= 64; todo -= 64) {
+		acc = 0;
+		for (i = 0; i < 64; i += sizeof(w)) {
+			memcpy(&w, buf + i, sizeof(w));
+			acc |= w;
+		}
+		if (acc != 0)
+			return 0;
+		buf += 64;
+	}
+	for (; todo > 0; todo--) {
+		if (*buf++ != 0)
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * return the index in the enc_funcs[] and dec_funcs[] tables of the
+ * converter to use for the given encoding, 0 being the generic one
+ */
+static int
+conv_getfmt(struct aparams *par)
+{
+	int fmt;
+
+	if (par->flt)
+		return (par->le == ADATA_LE) ? 9 : 10;
+
+	switch (par->bps) {
+	case 2:
+		fmt = 1;
+		break;
+	case 4:
+		fmt = 5;
+		break;
+	default:
+		return 0;
+	}
+	if (par->le != ADATA_LE)
+		fmt += 2;
+	if (!par->sig)
+		fmt += 1;
+	return fmt;
+}
+
 /*
  * initialize encoder from native to foreign encoding
  */
@@ -601,6 +1092,7 @@ enc_init(struct conv *p, struct aparams *par, int nch)
 		p->bnext = 1;
 		p->snext = 0;
 	}
+	p->func = enc_funcs[conv_getfmt(par)];
 #ifdef DEBUG
 	logx(3, "enc: %s, %d channels",
 	    (aparams_enctostr(par, enc_str), enc_str), p->nch);
@@ -608,10 +1100,10 @@ enc_init(struct conv *p, struct aparams *par, int nch)
 }
 
 /*
- * decode "todo" frames from foreign to native encoding
+ * decode "todo" frames from foreign to native encoding, any encoding
  */
-void
-dec_do(struct conv *p, unsigned char *in, unsigned char *out, int todo)
+static void
+dec_do_any(struct conv *p, unsigned char *in, unsigned char *out, int todo)
 {
 	unsigned int f;
 	unsigned int ibps;
@@ -624,9 +1116,6 @@ dec_do(struct conv *p, unsigned char *in, unsigned char *out, int todo)
 	unsigned int ishift;
 	adata_t *odata;
 
-#ifdef DEBUG
-	logx(4, "dec: copying %u frames", todo);
-#endif
 	/*
 	 * Partially copy structures into local variables, to avoid
 	 * unnecessary indirections; this also allows the compiler to
@@ -658,6 +1147,184 @@ dec_do(struct conv *p, unsigned char *in, unsigned char *out, int todo)
 	}
 }
 
+/*
+ * convert a 16-bit or 32-bit word to an adata_t sample, see enc_word()
+ */
+DSP_INLINE adata_t
+dec_word(unsigned int s, unsigned int shift, unsigned int bps,
+    int swap, int sig)
+{
+	if (swap) {
+		if (bps == 2)
+			s = ((s & 0xff) << 8) | (s >> 8);
+		else
+			s = swap32(s);
+	}
+	s <<= shift;
+	if (!sig)
+		s ^= 1U << 31;
+	return (int)s >> (32 - ADATA_BITS);
+}
+
+/*
+ * decoder template for 16-bit and 32-bit words, see enc_do_word()
+ */
+DSP_INLINE void
+dec_do_word(struct conv *p, void *restrict in, void *restrict out, int todo,
+    unsigned int bps, int swap, int sig)
+{
+	unsigned int i, n, s, shift;
+	unsigned short *idata16;
+	unsigned int *idata32;
+	adata_t *odata;
+
+	idata16 = in;
+	idata32 = in;
+	odata = out;
+	shift = p->shift;
+	n = todo * p->nch;
+	for (; n >= CONV_BLKSZ; n -= CONV_BLKSZ) {
+		for (i = 0; i < CONV_BLKSZ; i++) {
+			s = (bps == 2) ? *idata16++ : *idata32++;
+			*odata++ = dec_word(s, shift, bps, swap, sig);
+		}
+	}
+	for (; n > 0; n--) {
+		s = (bps == 2) ? *idata16++ : *idata32++;
+		*odata++ = dec_word(s, shift, bps, swap, sig);
+	}
+}
+
+static void
+dec_do_s16ne(struct conv *p, unsigned char *in, unsigned char *out, int todo)
+{
+	dec_do_word(p, in, out, todo, 2, 0, 1);
+}
+
+static void
+dec_do_u16ne(struct conv *p, unsigned char *in, unsigned char *out, int todo)
+{
+	dec_do_word(p, in, out, todo, 2, 0, 0);
+}
+
+static void
+dec_do_s16sw(struct conv *p, unsigned char *in, unsigned char *out, int todo)
+{
+	dec_do_word(p, in, out, todo, 2, 1, 1);
+}
+
+static void
+dec_do_u16sw(struct conv *p, unsigned char *in, unsigned char *out, int todo)
+{
+	dec_do_word(p, in, out, todo, 2, 1, 0);
+}
+
+static void
+dec_do_s32ne(struct conv *p, unsigned char *in, unsigned char *out, int todo)
+{
+	dec_do_word(p, in, out, todo, 4, 0, 1);
+}
+
+static void
+dec_do_u32ne(struct conv *p, unsigned char *in, unsigned char *out, int todo)
+{
+	dec_do_word(p, in, out, todo, 4, 0, 0);
+}
+
+static void
+dec_do_s32sw(struct conv *p, unsigned char *in, unsigned char *out, int todo)
+{
+	dec_do_word(p, in, out, todo, 4, 1, 1);
+}
+
+static void
+dec_do_u32sw(struct conv *p, unsigned char *in, unsigned char *out, int todo)
+{
+	dec_do_word(p, in, out, todo, 4, 1, 0);
+}
+
+/*
+ * convert a 32-bit float to adata_t, clipping to -1:1, boundaries
+ * excluded
+ */
+DSP_INLINE int
+f32_to_adata(unsigned int x)
+{
+	unsigned int s, e, m, y;
+
+	s = (x >> 31);
+	e = (x >> 23) & 0xff;
+	m = (x << 8) | 0x80000000;
+
+	/*
+	 * f32 exponent is (e - 127) and the point is after the 31-th
+	 * bit, thus the shift is:
+	 *
+	 * 31 - (BITS - 1) - (e - 127)
+	 *
+	 * to ensure output is in the 0..(2^BITS)-1 range, the minimum
+	 * shift is 31 - (BITS - 1) + 1, and maximum shift is 31
+	 */
+	if (e < 127 - (ADATA_BITS - 1))
+		y = 0;
+	else if (e >= 127)
+		y = ADATA_UNIT - 1;
+	else
+		y = m >> (127 + (32 - ADATA_BITS) - e);
+	return (y ^ -s) + s;
+}
+
+/*
+ * decoder template for 32-bit IEEE 754 floats
+ */
+DSP_INLINE void
+dec_do_flt(struct conv *p, void *restrict in, void *restrict out, int todo,
+    int swap)
+{
+	unsigned int n, s;
+	unsigned int *idata;
+	adata_t *odata;
+
+	idata = in;
+	odata = out;
+	for (n = todo * p->nch; n > 0; n--) {
+		s = *idata++;
+		*odata++ = f32_to_adata(swap ? swap32(s) : s);
+	}
+}
+
+static void
+dec_do_f32ne(struct conv *p, unsigned char *in, unsigned char *out, int todo)
+{
+	dec_do_flt(p, in, out, todo, 0);
+}
+
+static void
+dec_do_f32sw(struct conv *p, unsigned char *in, unsigned char *out, int todo)
+{
+	dec_do_flt(p, in, out, todo, 1);
+}
+
+static void (*dec_funcs[])(struct conv *,
+    unsigned char *, unsigned char *, int) = {
+	dec_do_any,
+	dec_do_s16ne, dec_do_u16ne, dec_do_s16sw, dec_do_u16sw,
+	dec_do_s32ne, dec_do_u32ne, dec_do_s32sw, dec_do_u32sw,
+	dec_do_f32ne, dec_do_f32sw
+};
+
+/*
+ * decode "todo" frames from foreign to native encoding
+ */
+void
+dec_do(struct conv *p, unsigned char *in, unsigned char *out, int todo)
+{
+#ifdef DEBUG
+	logx(4, "dec: copying %u frames", todo);
+#endif
+	p->func(p, in, out, todo);
+}
+
 /*
  * initialize decoder from foreign to native encoding
  */
@@ -689,6 +1356,7 @@ dec_init(struct conv *p, struct aparams *par, int nch)
 		p->bnext = 1;
 		p->snext = 0;
 	}
+	p->func = dec_funcs[conv_getfmt(par)];
 #ifdef DEBUG
 	logx(3, "dec: %s, %d channels",
 	    (aparams_enctostr(par, enc_str), enc_str), p->nch);
@@ -696,24 +1364,19 @@ dec_init(struct conv *p, struct aparams *par, int nch)
 }
 
 /*
- * mix "todo" input frames on the output with the given volume
+ * mix "todo" input frames on the output with the given volume, the
+ * number of channels is a template parameter
  */
-static void
-cmap_add(struct cmap *p, void *in, void *out, int vol, int todo)
+DSP_INLINE void
+cmap_add_nch(struct cmap *p, adata_t *idata, adata_t *odata, int vol, int todo,
+    int nch)
 {
-	adata_t *idata, *odata;
-	int i, j, nch, istart, inext, onext, ostart, y, v;
+	int i, j, istart, inext, onext, ostart, y, v;
 
-#ifdef DEBUG
-	logx(4, "cmap: adding %d frames", todo);
-#endif
-	idata = in;
-	odata = out;
 	ostart = p->ostart;
 	onext = p->onext;
 	istart = p->istart;
 	inext = p->inext;
-	nch = p->nch;
 	v = vol;
 
 	/*
@@ -738,24 +1401,19 @@ cmap_add(struct cmap *p, void *in, void *out, int vol, int todo)
 }
 
 /*
- * overwrite output with "todo" input frames with the given volume
+ * overwrite output with "todo" input frames with the given volume, the
+ * number of channels is a template parameter
  */
-static void
-cmap_copy(struct cmap *p, void *in, void *out, int vol, int todo)
+DSP_INLINE void
+cmap_copy_nch(struct cmap *p, adata_t *idata, adata_t *odata, int vol, int todo,
+    int nch)
 {
-	adata_t *idata, *odata;
-	int i, j, nch, istart, inext, onext, ostart, v;
+	int i, j, istart, inext, onext, ostart, v;
 
-#ifdef DEBUG
-	logx(4, "cmap: copying %d frames", todo);
-#endif
-	idata = in;
-	odata = out;
 	ostart = p->ostart;
 	onext = p->onext;
 	istart = p->istart;
 	inext = p->inext;
-	nch = p->nch;
 	v = vol;
 
 	/*
@@ -774,24 +1432,75 @@ cmap_copy(struct cmap *p, void *in, void *out, int vol, int todo)
 	}
 }
 
+static void
+cmap_add_any(struct cmap *p, adata_t *in, adata_t *out, int vol, int todo)
+{
+	cmap_add_nch(p, in, out, vol, todo, p->nch);
+}
+
+static void
+cmap_copy_any(struct cmap *p, adata_t *in, adata_t *out, int vol, int todo)
+{
+	cmap_copy_nch(p, in, out, vol, todo, p->nch);
+}
+
+static void
+cmap_add_mono(struct cmap *p, adata_t *in, adata_t *out, int vol, int todo)
+{
+	cmap_add_nch(p, in, out, vol, todo, 1);
+}
+
+static void
+cmap_copy_mono(struct cmap *p, adata_t *in, adata_t *out, int vol, int todo)
+{
+	cmap_copy_nch(p, in, out, vol, todo, 1);
+}
+
+static void
+cmap_add_stereo(struct cmap *p, adata_t *in, adata_t *out, int vol, int todo)
+{
+	cmap_add_nch(p, in, out, vol, todo, 2);
+}
+
+static void
+cmap_copy_stereo(struct cmap *p, adata_t *in, adata_t *out, int vol, int todo)
+{
+	cmap_copy_nch(p, in, out, vol, todo, 2);
+}
+
+static void
+cmap_add_8ch(struct cmap *p, adata_t *in, adata_t *out, int vol, int todo)
+{
+	cmap_add_nch(p, in, out, vol, todo, 8);
+}
+
+static void
+cmap_copy_8ch(struct cmap *p, adata_t *in, adata_t *out, int vol, int todo)
+{
+	cmap_copy_nch(p, in, out, vol, todo, 8);
+}
+
 /*
  * Mix or overwrite "todo" input frames on the output with the given volume
  */
 void
 cmap_do(struct cmap *p, adata_t *in, adata_t *out, int vol, int todo, int mix)
 {
-	void (*copy_func)(struct cmap *, void *, void *, int, int);
+	void (*copy_func)(struct cmap *, adata_t *, adata_t *, int, int);
 	int offs, i;
 
+#ifdef DEBUG
+	logx(4, "cmap: %s %d frames", mix ? "adding" : "copying", todo);
+#endif
 	vol /= p->join;
-	copy_func = mix ? cmap_add : cmap_copy;
+	copy_func = mix ? p->add : p->copy;
 
 	copy_func(p, in, out, vol, todo);
 
 	offs = 0;
 	for (i = p->join - 1; i > 0; i--) {
 		offs += p->nch;
-		cmap_add(p, in + offs, out, vol, todo);
+		p->add(p, in + offs, out, vol, todo);
 	}
 	offs = 0;
 	for (i = p->expand - 1; i > 0; i--) {
@@ -800,6 +1509,36 @@ cmap_do(struct cmap *p, adata_t *in, adata_t *out, int vol, int todo, int mix)
 	}
 }
 
+/*
+ * Mix or overwrite "todo" samples on the output with the given volume.
+ * Unlike cmap_do(), the sum is not clipped to the [-1:1] range, so it's
+ * suitable for intermediate sums that are processed further and clipped
+ * later. It's only saturated at SUM_MAX to avoid integer overflows when
+ * many full-scale streams are added; the resampler's filter overshoot
+ * still fits in a int at this bound.
+ */
+#define SUM_MAX		(ADATA_UNIT << 5)
+
+void
+sum_do(adata_t *in, adata_t *out, int vol, int todo, int mix)
+{
+	int i, s;
+
+	if (mix) {
+		for (i = 0; i < todo; i++) {
+			s = out[i] + ADATA_MUL(in[i], vol);
+			if (s > SUM_MAX)
+				s = SUM_MAX;
+			else if (s < -SUM_MAX)
+				s = -SUM_MAX;
+			out[i] = s;
+		}
+	} else {
+		for (i = 0; i < todo; i++)
+			out[i] = ADATA_MUL(in[i], vol);
+	}
+}
+
 /*
  * initialize channel mapper, to map a subset of input channel range
  * into a subset of the output channel range
@@ -851,6 +1590,24 @@ cmap_init(struct cmap *p,
 			p->expand = onch / nch;
 	}
 
+	switch (nch) {
+	case 1:
+		p->add = cmap_add_mono;
+		p->copy = cmap_copy_mono;
+		break;
+	case 2:
+		p->add = cmap_add_stereo;
+		p->copy = cmap_copy_stereo;
+		break;
+	case 8:
+		p->add = cmap_add_8ch;
+		p->copy = cmap_copy_8ch;
+		break;
+	default:
+		p->add = cmap_add_any;
+		p->copy = cmap_copy_any;
+	}
+
 #ifdef DEBUG
 	logx(3, "%s: nch = %d, join = %d, expand = %d, "
 	    "ostart = %d, onext = %d, istart = %d, inext = %d",  __func__,
@@ -60,6 +60,12 @@ typedef int adata_t;
  */
 #define RESAMP_RATIO		64
 
+/*
+ * Max number of precomputed filter coefficients, above this the
+ * coefficients are interpolated for each output frame
+ */
+#define RESAMP_NFILT		8192
+
 /*
  * Maximum size of the encoding string (the longest possible
  * encoding is ``s24le3msb'').
@@ -77,13 +83,21 @@ struct aparams {
 	unsigned int le;		/* 1 if little endian, else be */
 	unsigned int sig;		/* 1 if signed, 0 if unsigned */
 	unsigned int msb;		/* 1 if msb justified, else lsb */
+	unsigned int flt;		/* 1 if IEEE 754 float */
 };
 
 struct resamp {
 #define RESAMP_NCTX	(RESAMP_LENGTH / RESAMP_UNIT * RESAMP_RATIO)
 	unsigned int ctx_start;
-	adata_t ctx[NCHAN_MAX * RESAMP_NCTX];
+	unsigned int ctx_len;		/* history length, power of two */
+	/*
+	 * Each channel history is stored twice in a row, so the
+	 * filter can read ctx_len samples without wrapping
+	 */
+	adata_t *ctx;
 	int filt_cutoff, filt_step;
+	int *filt;			/* per-phase coefficients or NULL */
+	int filt_ntaps;			/* coefficients per phase */
 	unsigned int iblksz, oblksz;
 	int diff;
 	int nch;
@@ -97,6 +111,7 @@ struct conv {
 	int bnext;			/* to reach the next byte */
 	int snext;			/* to reach the next sample */
 	int nch;
+	void (*func)(struct conv *, unsigned char *, unsigned char *, int);
 };
 
 struct cmap {
@@ -107,6 +122,8 @@ struct cmap {
 	int nch;
 	int join;			/* channel join factor */
 	int expand;			/* channel expand factor */
+	void (*add)(struct cmap *, adata_t *, adata_t *, int, int);
+	void (*copy)(struct cmap *, adata_t *, adata_t *, int, int);
 };
 
 #define MIDI_TO_ADATA(m)	(aparams_ctltovol[m])
@@ -117,15 +134,21 @@ int aparams_strtoenc(struct aparams *, char *);
 int aparams_enctostr(struct aparams *, char *);
 int aparams_native(struct aparams *);
 
+void dsp_init(void);
 void resamp_getcnt(struct resamp *, int *, int *);
 void resamp_do(struct resamp *, adata_t *, adata_t *, int, int);
+void resamp_skip(struct resamp *, int, int);
 void resamp_init(struct resamp *, unsigned int, unsigned int, int);
+void resamp_reset(struct resamp *);
+void resamp_done(struct resamp *);
 void enc_do(struct conv *, unsigned char *, unsigned char *, int);
 void enc_sil_do(struct conv *, unsigned char *, int);
+int sil_test(unsigned char *, int);
 void enc_init(struct conv *, struct aparams *, int);
 void dec_do(struct conv *, unsigned char *, unsigned char *, int);
 void dec_init(struct conv *, struct aparams *, int);
 void cmap_do(struct cmap *, adata_t *, adata_t *, int, int, int);
+void sum_do(adata_t *, adata_t *, int, int, int);
 void cmap_init(struct cmap *, int, int, int, int, int, int, int, int, int);
 
 #endif /* !defined(DSP_H) */
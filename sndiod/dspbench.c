@@ -0,0 +1,276 @@
+/*	$OpenBSD$	*/
+/*
+ * Copyright (c) 2026 Alexandre Ratchov <alex@caoua.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+/*
+ * Throughput benchmark of the dsp.c kernels. Each kernel is run on a
+ * matrix of encodings, channel counts, rate ratios and block sizes,
+ * and one line is printed per case, with tab separated fields:
+ *
+ *	kernel params nch blksz fps cps
+ *
+ * where fps is the number of frames processed per second and cps the
+ * number of CPU cycles per sample (0 if no cycle counter is available).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "dsp.h"
+#include "utils.h"
+
+#define BENCH_MAXNCH	8
+#define BENCH_MAXBLK	4096
+
+unsigned int log_level = 0;
+
+/*
+ * minimum duration of each case, in nanoseconds
+ */
+long long bench_ns = 100000000;
+
+const char *bench_enc[] = {
+	"s16le", "s16be", "u16le", "s24le", "s24le3", "s32le", "s32be",
+	"u8", "f32le", "f32be", NULL
+};
+const int bench_nch[] = {1, 2, 8, 0};
+const int bench_blk[] = {64, 480, 4096, 0};
+const int bench_rate[][2] = {
+	{44100, 48000}, {48000, 44100}, {48000, 96000}, {8000, 48000},
+	{0, 0}
+};
+
+unsigned char bench_bytes[BENCH_MAXBLK * BENCH_MAXNCH * 4];
+
+/*
+ * twice the max block, so resampler input fits for any ratio below 2
+ */
+adata_t bench_in[2 * BENCH_MAXBLK * BENCH_MAXNCH];
+adata_t bench_out[BENCH_MAXBLK * BENCH_MAXNCH];
+
+struct bench {
+	long long ns;		/* elapsed time */
+	long long cyc;		/* elapsed CPU cycles */
+	long long t0, c0;
+};
+
+long long
+bench_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+long long
+bench_cycles(void)
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	return __builtin_ia32_rdtsc();
+#else
+	return 0;
+#endif
+}
+
+void
+bench_start(struct bench *b)
+{
+	b->t0 = bench_clock();
+	b->c0 = bench_cycles();
+}
+
+/*
+ * return true once the case ran long enough
+ */
+int
+bench_done(struct bench *b)
+{
+	b->ns = bench_clock() - b->t0;
+	b->cyc = bench_cycles() - b->c0;
+	return b->ns >= bench_ns;
+}
+
+void
+bench_report(struct bench *b, char *kernel, char *params,
+    int nch, int blk, long long nfr)
+{
+	printf("%s\t%s\t%d\t%d\t%.0f\t%.3f\n",
+	    kernel, params, nch, blk,
+	    (double)nfr * 1e9 / b->ns,
+	    (double)b->cyc / ((double)nfr * nch));
+}
+
+/*
+ * fill the input buffers with noise, so the kernels don't see
+ * any pattern
+ */
+void
+bench_fill(void)
+{
+	unsigned int i;
+
+	srandom(1);
+	for (i = 0; i < sizeof(bench_bytes); i++)
+		bench_bytes[i] = random();
+	for (i = 0; i < sizeof(bench_in) / sizeof(adata_t); i++)
+		bench_in[i] = (random() & (2 * ADATA_UNIT - 1)) - ADATA_UNIT;
+}
+
+void
+bench_conv(const char *enc, int nch, int blk)
+{
+	struct aparams par;
+	struct conv conv;
+	struct bench b;
+	long long nfr;
+	char params[16];
+
+	aparams_init(&par);
+	snprintf(params, sizeof(params), "%s", enc);
+	if (!aparams_strtoenc(&par, params)) {
+		fprintf(stderr, "%s: bad encoding\n", enc);
+		exit(1);
+	}
+
+	dec_init(&conv, &par, nch);
+	nfr = 0;
+	bench_start(&b);
+	do {
+		dec_do(&conv, bench_bytes, (unsigned char *)bench_out, blk);
+		nfr += blk;
+	} while (!bench_done(&b));
+	bench_report(&b, "dec", params, nch, blk, nfr);
+
+	enc_init(&conv, &par, nch);
+	nfr = 0;
+	bench_start(&b);
+	do {
+		enc_do(&conv, (unsigned char *)bench_in, bench_bytes, blk);
+		nfr += blk;
+	} while (!bench_done(&b));
+	bench_report(&b, "enc", params, nch, blk, nfr);
+
+	nfr = 0;
+	bench_start(&b);
+	do {
+		enc_sil_do(&conv, bench_bytes, blk);
+		nfr += blk;
+	} while (!bench_done(&b));
+	bench_report(&b, "enc_sil", params, nch, blk, nfr);
+}
+
+void
+bench_resamp(int irate, int orate, int nch, int blk)
+{
+	struct resamp resamp;
+	struct bench b;
+	long long nfr;
+	int iblk, oblk;
+	char params[32];
+
+	/*
+	 * blk is the device (output) block, as in sndiod
+	 */
+	oblk = blk;
+	iblk = ((long long)blk * irate + orate / 2) / orate;
+	if (iblk == 0 || iblk > 2 * BENCH_MAXBLK)
+		return;
+	resamp_init(&resamp, iblk, oblk, nch);
+	nfr = 0;
+	bench_start(&b);
+	do {
+		resamp_do(&resamp, bench_in, bench_out, iblk, oblk);
+		nfr += oblk;
+	} while (!bench_done(&b));
+	resamp_done(&resamp);
+	snprintf(params, sizeof(params), "%d:%d", irate, orate);
+	bench_report(&b, "resamp", params, nch, blk, nfr);
+}
+
+void
+bench_cmap(int inch, int onch, int mix, int blk)
+{
+	struct cmap cmap;
+	struct bench b;
+	long long nfr;
+	char params[32];
+
+	cmap_init(&cmap,
+	    0, inch - 1, 0, inch - 1,
+	    0, onch - 1, 0, onch - 1,
+	    1);
+	nfr = 0;
+	bench_start(&b);
+	do {
+		cmap_do(&cmap, bench_in, bench_out, ADATA_UNIT / 2, blk, mix);
+		nfr += blk;
+	} while (!bench_done(&b));
+	snprintf(params, sizeof(params), "%s:%d", mix ? "add" : "copy", inch);
+	bench_report(&b, "cmap", params, onch, blk, nfr);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char **enc;
+	const int *nch, *blk, (*rate)[2];
+	int c, mix;
+
+	while ((c = getopt(argc, argv, "t:")) != -1) {
+		switch (c) {
+		case 't':
+			bench_ns = atoll(optarg) * 1000000;
+			if (bench_ns <= 0) {
+				fprintf(stderr, "%s: bad duration\n", optarg);
+				exit(1);
+			}
+			break;
+		default:
+			fprintf(stderr, "usage: dspbench [-t msec]\n");
+			exit(1);
+		}
+	}
+
+	dsp_init();
+	bench_fill();
+
+	printf("# kernel\tparams\tnch\tblksz\tfps\tcps\n");
+	for (enc = bench_enc; *enc != NULL; enc++) {
+		for (nch = bench_nch; *nch != 0; nch++) {
+			for (blk = bench_blk; *blk != 0; blk++)
+				bench_conv(*enc, *nch, *blk);
+		}
+	}
+	for (rate = bench_rate; (*rate)[0] != 0; rate++) {
+		for (nch = bench_nch; *nch != 0; nch++) {
+			for (blk = bench_blk; *blk != 0; blk++)
+				bench_resamp((*rate)[0], (*rate)[1],
+				    *nch, *blk);
+		}
+	}
+	for (mix = 0; mix < 2; mix++) {
+		for (nch = bench_nch; *nch != 0; nch++) {
+			for (blk = bench_blk; *blk != 0; blk++) {
+				bench_cmap(*nch, *nch, mix, *blk);
+				if (*nch < BENCH_MAXNCH)
+					bench_cmap(*nch, BENCH_MAXNCH,
+					    mix, *blk);
+			}
+		}
+	}
+	return 0;
+}
@@ -19,6 +19,13 @@
  * both). To achieve non-blocking io, we simply use the poll() syscall
  * in an event loop and dispatch events to sub-modules.
  *
+ * If USE_EPOLL is defined, epoll(7) is used instead. The descriptors
+ * returned by the pollfd() handler of each file are kept registered.
+ * The handler is called again only for files marked with file_update(),
+ * which sub-modules must do whenever something the handler depends on
+ * changes; files are marked automatically when created and after their
+ * events are processed. Only files with pending events are processed.
+ *
  * the module also provides trivial timeout implementation,
  * derived from:
  *
@@ -28,8 +35,8 @@
  * 		midish/mdep.c rev 1.71
  *
  * A timeout is used to schedule the call of a routine (the callback)
- * there is a global list of timeouts that is processed inside the
- * event loop. Timeouts work as follows:
+ * there is a global heap of timeouts, ordered by expiration time, that
+ * is processed inside the event loop. Timeouts work as follows:
  *
  *	first the timo structure must be initialized with timo_set()
  *
@@ -42,9 +49,18 @@
  *	the timeout can be aborted with timo_del(), it is OK to try to
  *	abort a timeout that has expired
  *
+ * If HAVE_TIMERFD is defined, the event loop is woken up by a timerfd(2)
+ * armed with the first timeout, rather than by the poll(2) timeout,
+ * which is rounded to milliseconds.
  */
 
 #include <sys/types.h>
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#endif
+#ifdef HAVE_TIMERFD
+#include <sys/timerfd.h>
+#endif
 
 #include <errno.h>
 #include <fcntl.h>
@@ -52,28 +68,149 @@
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
 #include "bsd-compat.h"
 
 #include "file.h"
 #include "utils.h"
 
-#define MAXFDS 100
 #define TIMER_MSEC 5
+#define FILE_NEVENTS 64
 
+int timo_before(struct timo *, struct timo *);
+void timo_up(struct timo *, unsigned int);
+void timo_down(struct timo *, unsigned int);
+void timo_rm(unsigned int);
 void timo_update(unsigned int);
+#ifdef HAVE_TIMERFD
+void timo_settimer(void);
+#endif
 void timo_init(void);
 void timo_done(void);
+void file_yield(void);
 int file_process(struct file *, struct pollfd *);
+#ifdef USE_EPOLL
+void file_epoll_ctl(struct file *, int, struct pollfd *);
+void file_epoll_update(struct file *, struct pollfd *, int);
+struct file *file_epoll_ready(struct epoll_event *, int);
+#endif
 
 struct timespec file_ts;
 struct file *file_list;
-struct timo *timo_queue;
+struct timo **timo_heap;	/* binary heap, first timeout at the root */
+unsigned int timo_nheap;	/* number of timeouts in the heap */
+unsigned int timo_heapsz;	/* number of entries in timo_heap */
+unsigned int timo_seq;		/* to run equal timeouts in order */
 unsigned int timo_abstime;
-int file_slowaccept = 0, file_nfds;
+#ifdef HAVE_TIMERFD
+int timo_fd;			/* timerfd waking the event loop */
+int timo_fdset;			/* 1 if armed, -1 if expired */
+unsigned int timo_fdval;	/* value it's armed with */
+#endif
+int file_slowaccept = 0;
+unsigned int file_nfds;		/* max descriptors of all files */
+unsigned int file_nzomb;	/* files to free */
+#ifndef USE_EPOLL
+struct pollfd *file_pfds;	/* array passed to poll(2) */
+unsigned int file_pfdsz;	/* number of entries in file_pfds */
+#endif
+#ifdef USE_THREADS
+pthread_rwlock_t file_lock;
+pthread_mutex_t file_waitmtx = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t file_waitcond = PTHREAD_COND_INITIALIZER;
+int file_nwait;			/* device threads waiting for the lock */
+#endif
 #ifdef DEBUG
 long long file_wtime, file_utime;
 #endif
+#ifdef USE_EPOLL
+int file_epfd;
+struct file *file_ulist;	/* files whose events may have changed */
+struct file **file_fdtab;	/* file owning each registered descriptor */
+int file_fdtabsz;		/* number of entries in file_fdtab */
+#endif
+
+/*
+ * return true if the 'a' timeout expires before the 'b' one. There is
+ * no overflow here because + and - are modulo 2^32, they are the same
+ * for both signed and unsigned integers
+ */
+int
+timo_before(struct timo *a, struct timo *b)
+{
+	int diff;
+
+	diff = a->val - b->val;
+	if (diff != 0)
+		return diff < 0;
+	return (int)(a->seq - b->seq) < 0;
+}
+
+/*
+ * store the timeout at the given heap position, moving it toward the
+ * root while it expires before its parent
+ */
+void
+timo_up(struct timo *o, unsigned int i)
+{
+	unsigned int p;
+
+	while (i > 0) {
+		p = (i - 1) / 2;
+		if (!timo_before(o, timo_heap[p]))
+			break;
+		timo_heap[i] = timo_heap[p];
+		timo_heap[i]->idx = i;
+		i = p;
+	}
+	timo_heap[i] = o;
+	o->idx = i;
+}
+
+/*
+ * store the timeout at the given heap position, moving it toward the
+ * leaves while one of its children expires before it
+ */
+void
+timo_down(struct timo *o, unsigned int i)
+{
+	unsigned int c;
+
+	for (;;) {
+		c = 2 * i + 1;
+		if (c >= timo_nheap)
+			break;
+		if (c + 1 < timo_nheap &&
+		    timo_before(timo_heap[c + 1], timo_heap[c]))
+			c++;
+		if (!timo_before(timo_heap[c], o))
+			break;
+		timo_heap[i] = timo_heap[c];
+		timo_heap[i]->idx = i;
+		i = c;
+	}
+	timo_heap[i] = o;
+	o->idx = i;
+}
+
+/*
+ * remove the timeout at the given heap position
+ */
+void
+timo_rm(unsigned int i)
+{
+	struct timo *last;
+
+	last = timo_heap[--timo_nheap];
+	if (i == timo_nheap)
+		return;
+	if (i > 0 && timo_before(last, timo_heap[(i - 1) / 2]))
+		timo_up(last, i);
+	else
+		timo_down(last, i);
+}
 
 /*
  * initialise a timeout structure, arguments are callback and argument
@@ -94,9 +231,7 @@ timo_set(struct timo *o, void (*cb)(void *), void *arg)
 void
 timo_add(struct timo *o, unsigned int delta)
 {
-	struct timo **i;
-	unsigned int val;
-	int diff;
+	struct timo **heap;
 
 #ifdef DEBUG
 	if (o->set) {
@@ -108,17 +243,20 @@ timo_add(struct timo *o, unsigned int delta)
 		panic();
 	}
 #endif
-	val = timo_abstime + delta;
-	for (i = &timo_queue; *i != NULL; i = &(*i)->next) {
-		diff = (*i)->val - val;
-		if (diff > 0) {
-			break;
+	if (timo_nheap == timo_heapsz) {
+		timo_heapsz = timo_heapsz > 0 ? 2 * timo_heapsz : 16;
+		heap = xmalloc(timo_heapsz * sizeof(struct timo *));
+		if (timo_heap != NULL) {
+			memcpy(heap, timo_heap,
+			    timo_nheap * sizeof(struct timo *));
+			xfree(timo_heap);
 		}
+		timo_heap = heap;
 	}
 	o->set = 1;
-	o->val = val;
-	o->next = *i;
-	*i = o;
+	o->val = timo_abstime + delta;
+	o->seq = timo_seq++;
+	timo_up(o, timo_nheap++);
 }
 
 /*
@@ -127,18 +265,14 @@ timo_add(struct timo *o, unsigned int delta)
 void
 timo_del(struct timo *o)
 {
-	struct timo **i;
-
-	for (i = &timo_queue; *i != NULL; i = &(*i)->next) {
-		if (*i == o) {
-			*i = o->next;
-			o->set = 0;
-			return;
-		}
-	}
+	if (!o->set) {
 #ifdef DEBUG
-	logx(4, "timo_del: not found");
+		logx(4, "timo_del: not found");
 #endif
+		return;
+	}
+	timo_rm(o->idx);
+	o->set = 0;
 }
 
 /*
@@ -158,32 +292,86 @@ timo_update(unsigned int delta)
 	timo_abstime += delta;
 
 	/*
-	 * remove from the queue and run expired timeouts
+	 * remove from the heap and run expired timeouts
 	 */
-	while (timo_queue != NULL) {
-		/*
-		 * there is no overflow here because + and - are
-		 * modulo 2^32, they are the same for both signed and
-		 * unsigned integers
-		 */
-		diff = timo_queue->val - timo_abstime;
+	while (timo_nheap > 0) {
+		to = timo_heap[0];
+		diff = to->val - timo_abstime;
 		if (diff > 0)
 			break;
-		to = timo_queue;
-		timo_queue = to->next;
+		timo_rm(0);
 		to->set = 0;
 		to->cb(to->arg);
+		file_yield();
 	}
 }
 
+#ifdef HAVE_TIMERFD
+/*
+ * arm the timerfd to expire with the first timeout, or disarm it if
+ * there are none. The file_ts time corresponds to timo_abstime.
+ *
+ * If the timer is already armed to expire no later than the first
+ * timeout, keep it: at worst it wakes us up early and is re-armed
+ * then. This way, pushing back a timeout, as the watchdog on each
+ * device cycle, doesn't cost a system call.
+ */
+void
+timo_settimer(void)
+{
+	struct itimerspec its;
+	long long ns;
+
+	memset(&its, 0, sizeof(struct itimerspec));
+	if (timo_nheap == 0) {
+		/*
+		 * disarm it only once expired, as it stays readable
+		 */
+		if (timo_fdset != -1)
+			return;
+		timo_fdset = 0;
+	} else {
+		if (timo_fdset == 1 &&
+		    (int)(timo_heap[0]->val - timo_fdval) >= 0)
+			return;
+		ns = 1000LL * (int)(timo_heap[0]->val - timo_abstime);
+		if (ns <= 0)
+			ns = 1;
+		ns += 1000000000LL * file_ts.tv_sec + file_ts.tv_nsec;
+		its.it_value.tv_sec = ns / 1000000000;
+		its.it_value.tv_nsec = ns % 1000000000;
+		timo_fdset = 1;
+		timo_fdval = timo_heap[0]->val;
+	}
+
+	/*
+	 * this also clears the expirations count, so there's no need to
+	 * read(2) the timerfd once it has expired
+	 */
+	if (timerfd_settime(timo_fd, TFD_TIMER_ABSTIME, &its, NULL) == -1) {
+		logx(0, "timo_settimer: timerfd_settime failed");
+		panic();
+	}
+}
+#endif
+
 /*
  * initialize timeout queue
  */
 void
 timo_init(void)
 {
-	timo_queue = NULL;
+	timo_heap = NULL;
+	timo_nheap = timo_heapsz = 0;
 	timo_abstime = 0;
+#ifdef HAVE_TIMERFD
+	timo_fd = timerfd_create(CLOCK_UPTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timo_fd == -1) {
+		logx(0, "timo_init: timerfd_create failed");
+		panic();
+	}
+	timo_fdset = 0;
+#endif
 }
 
 /*
@@ -193,12 +381,17 @@ void
 timo_done(void)
 {
 #ifdef DEBUG
-	if (timo_queue != NULL) {
-		logx(0, "timo_done: timo_queue not empty!");
+	if (timo_nheap != 0) {
+		logx(0, "timo_done: timo_heap not empty!");
 		panic();
 	}
 #endif
-	timo_queue = (struct timo *)0xdeadbeef;
+	if (timo_heap != NULL)
+		xfree(timo_heap);
+	timo_heap = NULL;
+#ifdef HAVE_TIMERFD
+	close(timo_fd);
+#endif
 }
 
 struct file *
@@ -206,21 +399,21 @@ file_new(struct fileops *ops, void *arg, char *name, unsigned int nfds)
 {
 	struct file *f;
 
-	if (file_nfds + nfds > MAXFDS) {
-#ifdef DEBUG
-		logx(1, "%s: too many polled files", name);
-#endif
-		return NULL;
-	}
 	f = xmalloc(sizeof(struct file));
 	f->max_nfds = nfds;
 	f->nfds = 0;
+#ifdef USE_EPOLL
+	f->pfds = xmalloc(2 * nfds * sizeof(struct pollfd));
+	f->ready = 0;
+	f->update = 0;
+#endif
 	f->ops = ops;
 	f->arg = arg;
 	f->name = name;
 	f->state = FILE_INIT;
 	f->next = file_list;
 	file_list = f;
+	file_update(f);
 #ifdef DEBUG
 	logx(3, "%s: created", f->name);
 #endif
@@ -236,14 +429,84 @@ file_del(struct file *f)
 		logx(0, "%s: %s: bad state in file_del", __func__, f->name);
 		panic();
 	}
+#endif
+#ifdef USE_EPOLL
+	/*
+	 * unregister now, as the descriptors are closed next and their
+	 * numbers may be reused before the zombie is freed
+	 */
+	file_epoll_update(f, NULL, 0);
 #endif
 	file_nfds -= f->max_nfds;
+	file_nzomb++;
 	f->state = FILE_ZOMB;
 #ifdef DEBUG
 	logx(3, "%s: destroyed", f->name);
 #endif
 }
 
+/*
+ * the state the pollfd() handler of the given file depends on has
+ * changed, so call it again before sleeping
+ */
+void
+file_update(struct file *f)
+{
+#ifdef USE_EPOLL
+	if (f->update)
+		return;
+	f->update = 1;
+	f->unext = file_ulist;
+	file_ulist = f;
+#endif
+}
+
+/*
+ * hand the lock to the waiting device threads, if any, called by the
+ * main loop between the operations it processes. This way, a device
+ * thread doesn't wait for all pending events to be processed, but
+ * only for the current one. We wait for the threads to actually get
+ * the lock, because rwlocks don't guarantee that a writer relocking
+ * immediately doesn't take it again first
+ */
+void
+file_yield(void)
+{
+#ifdef USE_THREADS
+	pthread_mutex_lock(&file_waitmtx);
+	if (file_nwait == 0) {
+		pthread_mutex_unlock(&file_waitmtx);
+		return;
+	}
+	pthread_rwlock_unlock(&file_lock);
+	while (file_nwait > 0)
+		pthread_cond_wait(&file_waitcond, &file_waitmtx);
+	pthread_mutex_unlock(&file_waitmtx);
+	pthread_rwlock_wrlock(&file_lock);
+#endif
+}
+
+#ifdef USE_THREADS
+/*
+ * take the read lock, called by device threads. Let file_yield() know
+ * we're waiting, so the main loop hands the lock to us
+ */
+void
+file_rdlock(void)
+{
+	pthread_mutex_lock(&file_waitmtx);
+	file_nwait++;
+	pthread_mutex_unlock(&file_waitmtx);
+
+	pthread_rwlock_rdlock(&file_lock);
+
+	pthread_mutex_lock(&file_waitmtx);
+	if (--file_nwait == 0)
+		pthread_cond_signal(&file_waitcond);
+	pthread_mutex_unlock(&file_waitmtx);
+}
+#endif
+
 int
 file_process(struct file *f, struct pollfd *pfd)
 {
@@ -295,6 +558,9 @@ filelist_fmt(char *buf, size_t size, struct pollfd *pfd, int ret)
 
 	for (f = file_list; f != NULL; f = f->next) {
 		p += snprintf(p, p < end ? end - p : 0, "%s%s:", sep, f->name);
+#ifdef USE_EPOLL
+		pfd = f->pfds;
+#endif
 		for (i = 0; i < f->nfds; i++) {
 			p += snprintf(p, p < end ? end - p : 0, " 0x%x",
 			    ret ? pfd->revents : pfd->events);
@@ -306,10 +572,142 @@ filelist_fmt(char *buf, size_t size, struct pollfd *pfd, int ret)
 }
 #endif
 
+#ifdef USE_EPOLL
+/*
+ * add, modify or remove a descriptor of the given file from the epoll(7)
+ * interest set
+ */
+void
+file_epoll_ctl(struct file *f, int op, struct pollfd *pfd)
+{
+	struct epoll_event ev;
+	struct file **tab;
+	int n;
+
+	if (pfd->fd < 0)
+		return;
+	ev.events = pfd->events & (POLLIN | POLLOUT | POLLPRI);
+	ev.data.fd = pfd->fd;
+	if (op == EPOLL_CTL_DEL) {
+		if (pfd->fd < file_fdtabsz && file_fdtab[pfd->fd] == f)
+			file_fdtab[pfd->fd] = NULL;
+
+		/* the descriptor may be already closed, ignore errors */
+		epoll_ctl(file_epfd, op, pfd->fd, &ev);
+		return;
+	}
+	if (pfd->fd >= file_fdtabsz) {
+		n = file_fdtabsz > 0 ? file_fdtabsz : 64;
+		while (n <= pfd->fd)
+			n *= 2;
+		tab = xmalloc(n * sizeof(struct file *));
+		memset(tab, 0, n * sizeof(struct file *));
+		if (file_fdtab != NULL) {
+			memcpy(tab, file_fdtab,
+			    file_fdtabsz * sizeof(struct file *));
+			xfree(file_fdtab);
+		}
+		file_fdtab = tab;
+		file_fdtabsz = n;
+	}
+	file_fdtab[pfd->fd] = f;
+	if (epoll_ctl(file_epfd, op, pfd->fd, &ev) == 0)
+		return;
+
+	/*
+	 * a descriptor may be closed and its number reused without the
+	 * file noticing, so retry with the other operation
+	 */
+	if (errno == EEXIST)
+		op = EPOLL_CTL_MOD;
+	else if (errno == ENOENT)
+		op = EPOLL_CTL_ADD;
+	else
+		op = -1;
+	if (op == -1 || epoll_ctl(file_epfd, op, pfd->fd, &ev) == -1) {
+		logx(0, "%s: epoll_ctl failed", f->name);
+		panic();
+	}
+}
+
+/*
+ * update the descriptors registered for the given file to match the
+ * ones returned by its pollfd() handler. Nothing is done for the
+ * descriptors that didn't change, which is the common case
+ */
+void
+file_epoll_update(struct file *f, struct pollfd *pfds, int nfds)
+{
+	struct pollfd *reg = f->pfds;
+	int i;
+
+	for (i = 0; i < nfds; i++) {
+		if (i < f->nfds) {
+			if (reg[i].fd == pfds[i].fd) {
+				if (reg[i].events != pfds[i].events) {
+					file_epoll_ctl(f, EPOLL_CTL_MOD,
+					    pfds + i);
+				}
+				continue;
+			}
+			file_epoll_ctl(f, EPOLL_CTL_DEL, reg + i);
+		}
+		file_epoll_ctl(f, EPOLL_CTL_ADD, pfds + i);
+	}
+	for (; i < f->nfds; i++)
+		file_epoll_ctl(f, EPOLL_CTL_DEL, reg + i);
+	for (i = 0; i < nfds; i++) {
+		reg[i].fd = pfds[i].fd;
+		reg[i].events = pfds[i].events;
+		reg[i].revents = 0;
+	}
+	f->nfds = nfds;
+}
+
+/*
+ * store the events returned by epoll_wait(2) in the pollfd structures
+ * of their files, and chain the files, so each one is processed once
+ */
+struct file *
+file_epoll_ready(struct epoll_event *evs, int nevs)
+{
+	struct file *f, *rlist;
+	int i, j;
+
+	rlist = NULL;
+	for (i = 0; i < nevs; i++) {
+#ifdef HAVE_TIMERFD
+		if (evs[i].data.fd == timo_fd) {
+			timo_fdset = -1;
+			continue;
+		}
+#endif
+		f = file_fdtab[evs[i].data.fd];
+		if (f == NULL)
+			continue;
+		for (j = 0; j < f->nfds; j++) {
+			if (f->pfds[j].fd == evs[i].data.fd)
+				f->pfds[j].revents = evs[i].events;
+		}
+		if (!f->ready) {
+			f->ready = 1;
+			f->rnext = rlist;
+			rlist = f;
+		}
+	}
+	return rlist;
+}
+#endif
+
 int
 file_poll(void)
 {
-	struct pollfd pfds[MAXFDS], *pfd;
+#ifdef USE_EPOLL
+	struct epoll_event evs[FILE_NEVENTS];
+	struct file *rlist, *ulist;
+#else
+	struct pollfd *pfd;
+#endif
 	struct file *f, **pf;
 	struct timespec ts;
 #ifdef DEBUG
@@ -317,50 +715,107 @@ file_poll(void)
 	char str[128];
 #endif
 	long long delta_nsec;
-	int nfds, res, timo;
+	int res, timo, nfds;
+
+#ifdef USE_EPOLL
+	/*
+	 * update the descriptors of the files marked with file_update(),
+	 * before zombies are freed as there may be some on the list. Files
+	 * without descriptors are kept on it to be processed at every
+	 * iteration, see below
+	 */
+	ulist = file_ulist;
+	file_ulist = NULL;
+	while ((f = ulist) != NULL) {
+		ulist = f->unext;
+		f->update = 0;
+		if (f->state == FILE_ZOMB)
+			continue;
+		nfds = f->ops->pollfd(f->arg, f->pfds + f->max_nfds);
+		file_epoll_update(f, f->pfds + f->max_nfds, nfds);
+		if (nfds == 0)
+			file_update(f);
+		file_yield();
+	}
+#endif
 
 	/*
 	 * cleanup zombies
 	 */
 	pf = &file_list;
-	while ((f = *pf) != NULL) {
+	while (file_nzomb > 0 && (f = *pf) != NULL) {
 		if (f->state == FILE_ZOMB) {
 			*pf = f->next;
+#ifdef USE_EPOLL
+			xfree(f->pfds);
+#endif
 			xfree(f);
+			file_nzomb--;
 		} else
 			pf = &f->next;
 	}
 
-	if (file_list == NULL && timo_queue == NULL) {
+	if (file_list == NULL && timo_nheap == 0) {
 #ifdef DEBUG
 		logx(3, "nothing to do...");
 #endif
 		return 0;
 	}
 
+#ifdef USE_EPOLL
+#ifdef DEBUG
+	if (log_level >= 4) {
+		logx(4, "poll [%s]",
+		    (filelist_fmt(str, sizeof(str), NULL, 0), str));
+	}
+#endif
+#else
+	/*
+	 * grow the array here, as files may be created while the
+	 * previous one is being processed
+	 */
+	if (file_pfdsz < file_nfds + 1) {
+		if (file_pfds != NULL)
+			xfree(file_pfds);
+		file_pfdsz = file_pfdsz > 0 ? file_pfdsz : 64;
+		while (file_pfdsz < file_nfds + 1)
+			file_pfdsz *= 2;
+		file_pfds = xmalloc(file_pfdsz * sizeof(struct pollfd));
+	}
+
 	/*
 	 * fill pollfd structures
 	 */
 	nfds = 0;
 	for (f = file_list; f != NULL; f = f->next) {
-		f->nfds = f->ops->pollfd(f->arg, pfds + nfds);
+		f->nfds = f->ops->pollfd(f->arg, file_pfds + nfds);
 		if (f->nfds == 0)
 			continue;
 		nfds += f->nfds;
 	}
 #ifdef DEBUG
-	logx(4, "poll [%s]", (filelist_fmt(str, sizeof(str), pfds, 0), str));
+	logx(4, "poll [%s]",
+	    (filelist_fmt(str, sizeof(str), file_pfds, 0), str));
+#endif
 #endif
 
 	/*
 	 * process files that do not rely on poll
 	 */
 	res = 0;
+#ifdef USE_EPOLL
+	for (f = file_ulist; f != NULL; f = f->unext) {
+		res |= file_process(f, NULL);
+		file_yield();
+	}
+#else
 	for (f = file_list; f != NULL; f = f->next) {
 		if (f->nfds > 0)
 			continue;
 		res |= file_process(f, NULL);
+		file_yield();
 	}
+#endif
 	/*
 	 * The processing may have changed the poll(2) conditions of
 	 * other files, so restart the loop to force their poll(2) event
@@ -380,14 +835,37 @@ file_poll(void)
 	file_utime += 1000000000LL * (sleepts.tv_sec - file_ts.tv_sec);
 	file_utime += sleepts.tv_nsec - file_ts.tv_nsec;
 #endif
-	if (timo_queue != NULL) {
-		timo = ((int)timo_queue->val - (int)timo_abstime) / 1000;
+#ifdef HAVE_TIMERFD
+	timo_settimer();
+	timo = -1;
+#else
+	if (timo_nheap > 0) {
+		timo = ((int)timo_heap[0]->val - (int)timo_abstime) / 1000;
 		if (timo < TIMER_MSEC)
 			timo = TIMER_MSEC;
 	} else
 		timo = -1;
+#endif
 	log_flush();
-	res = poll(pfds, nfds, timo);
+#ifdef USE_THREADS
+	pthread_rwlock_unlock(&file_lock);
+#endif
+#ifdef USE_EPOLL
+	res = epoll_wait(file_epfd, evs, FILE_NEVENTS, timo);
+#else
+#ifdef HAVE_TIMERFD
+	file_pfds[nfds].fd = timo_fd;
+	file_pfds[nfds].events = POLLIN;
+	res = poll(file_pfds, nfds + 1, timo);
+	if (res > 0 && file_pfds[nfds].revents)
+		timo_fdset = -1;
+#else
+	res = poll(file_pfds, nfds, timo);
+#endif
+#endif
+#ifdef USE_THREADS
+	pthread_rwlock_wrlock(&file_lock);
+#endif
 	if (res == -1) {
 		if (errno != EINTR) {
 			logx(0, "poll failed");
@@ -395,6 +873,9 @@ file_poll(void)
 		}
 		return 1;
 	}
+#ifdef USE_EPOLL
+	rlist = file_epoll_ready(evs, res);
+#endif
 
 	/*
 	 * run timeouts
@@ -404,7 +885,7 @@ file_poll(void)
 	file_wtime += 1000000000LL * (ts.tv_sec - sleepts.tv_sec);
 	file_wtime += ts.tv_nsec - sleepts.tv_nsec;
 #endif
-	if (timo_queue) {
+	if (timo_nheap > 0) {
 		delta_nsec = 1000000000LL * (ts.tv_sec - file_ts.tv_sec);
 		delta_nsec += ts.tv_nsec - file_ts.tv_nsec;
 		if (delta_nsec >= 0 && delta_nsec < 60000000000LL)
@@ -417,19 +898,33 @@ file_poll(void)
 	/*
 	 * process files that rely on poll
 	 */
-	pfd = pfds;
+#ifdef USE_EPOLL
+	while ((f = rlist) != NULL) {
+		rlist = f->rnext;
+		f->ready = 0;
+		file_process(f, f->pfds);
+		file_update(f);
+		file_yield();
+	}
+#else
+	pfd = file_pfds;
 	for (f = file_list; f != NULL; f = f->next) {
 		if (f->nfds == 0)
 			continue;
 		file_process(f, pfd);
 		pfd += f->nfds;
+		file_yield();
 	}
+#endif
 	return 1;
 }
 
 void
 filelist_init(void)
 {
+#if defined(USE_EPOLL) && defined(HAVE_TIMERFD)
+	struct epoll_event ev;
+#endif
 	sigset_t set;
 
 	if (clock_gettime(CLOCK_UPTIME, &file_ts) == -1) {
@@ -440,9 +935,58 @@ filelist_init(void)
 	sigaddset(&set, SIGPIPE);
 	sigprocmask(SIG_BLOCK, &set, NULL);
 	file_list = NULL;
+	file_nfds = 0;
+	file_nzomb = 0;
 	log_sync = 0;
 	timo_init();
+#ifndef USE_EPOLL
+	file_pfds = NULL;
+	file_pfdsz = 0;
+#endif
+#ifdef USE_EPOLL
+	file_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (file_epfd == -1) {
+		logx(0, "filelist_init: epoll_create1 failed");
+		panic();
+	}
+	file_ulist = NULL;
+	file_fdtab = NULL;
+	file_fdtabsz = 0;
+#ifdef HAVE_TIMERFD
+	ev.events = EPOLLIN;
+	ev.data.fd = timo_fd;
+	if (epoll_ctl(file_epfd, EPOLL_CTL_ADD, timo_fd, &ev) == -1) {
+		logx(0, "filelist_init: couldn't register timerfd");
+		panic();
+	}
+#endif
+#endif
+}
+
+#ifdef USE_THREADS
+/*
+ * create the lock and take it for the main loop. The lock owner is
+ * lost by fork(2), so this must be done after daemon(3)
+ */
+void
+filelist_initlock(void)
+{
+	pthread_rwlockattr_t attr;
+
+	/*
+	 * device threads take the lock at every block, they must not
+	 * starve the main loop
+	 */
+	pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+	pthread_rwlockattr_setkind_np(&attr,
+	    PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+	pthread_rwlock_init(&file_lock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+	pthread_rwlock_wrlock(&file_lock);
 }
+#endif
 
 void
 filelist_done(void)
@@ -459,4 +1003,17 @@ filelist_done(void)
 	log_flush();
 #endif
 	timo_done();
+#ifndef USE_EPOLL
+	if (file_pfds != NULL)
+		xfree(file_pfds);
+#endif
+#ifdef USE_EPOLL
+	close(file_epfd);
+	if (file_fdtab != NULL)
+		xfree(file_fdtab);
+#endif
+#ifdef USE_THREADS
+	pthread_rwlock_unlock(&file_lock);
+	pthread_rwlock_destroy(&file_lock);
+#endif
 }
@@ -18,12 +18,16 @@
 #define FILE_H
 
 #include <sys/types.h>
+#ifdef USE_THREADS
+#include <pthread.h>
+#endif
 
 struct file;
 struct pollfd;
 
 struct timo {
-	struct timo *next;
+	unsigned int idx;		/* position in the heap */
+	unsigned int seq;		/* insertion order */
 	unsigned int val;		/* time to wait before the callback */
 	unsigned int set;		/* true if the timeout is set */
 	void (*cb)(void *arg);		/* routine to call on expiration */
@@ -55,11 +59,27 @@ struct file {
 	unsigned int max_nfds;		/* max number of descriptors */
 	unsigned int nfds;		/* number of descriptors polled */
 	char *name;			/* for debug purposes */
+#ifdef USE_EPOLL
+	struct pollfd *pfds;		/* registered fds, then scratch */
+	struct file *rnext;		/* next in the ready list */
+	unsigned int ready;		/* true if in the ready list */
+	struct file *unext;		/* next in the update list */
+	unsigned int update;		/* true if in the update list */
+#endif
 };
 
 extern struct file *file_list;
 extern int file_slowaccept;
 
+#ifdef USE_THREADS
+/*
+ * The main loop holds the write lock, except while sleeping in poll(2)
+ * and between the events it processes. Device threads hold the read
+ * lock while touching the daemon state, they take it with file_rdlock().
+ */
+extern pthread_rwlock_t file_lock;
+#endif
+
 #ifdef DEBUG
 extern long long file_wtime, file_utime;
 #endif
@@ -70,10 +90,15 @@ void timo_del(struct timo *);
 
 void filelist_init(void);
 void filelist_done(void);
+#ifdef USE_THREADS
+void filelist_initlock(void);
+void file_rdlock(void);
+#endif
 size_t filelist_fmt(char *, size_t, struct pollfd *, int);
 
 struct file *file_new(struct fileops *, void *, char *, unsigned int);
 void file_del(struct file *);
+void file_update(struct file *);
 
 int file_poll(void);
 
@@ -150,7 +150,7 @@ midi_link(struct midi *ep, struct midi *peer)
 	}
 	if ((ep->mode & MODE_MIDIIN) && (peer->mode & MODE_MIDIOUT)) {
 #ifdef DEBUG
-		if (ep->obuf.used > 0) {
+		if (abuf_used(&ep->obuf) > 0) {
 			logx(0, "midi%u: linked with non-empty buffer", ep->num);
 			panic();
 		}
@@ -233,7 +233,7 @@ midi_tickets(struct midi *iep)
 		if ((iep->txmask & (1 << i)) == 0)
 			continue;
 		oep = midi_ep + i;
-		avail = oep->obuf.len - oep->obuf.used;
+		avail = oep->obuf.len - abuf_used(&oep->obuf);
 		if (maxavail > avail)
 			maxavail = avail;
 	}
@@ -342,12 +342,12 @@ midi_out(struct midi *oep, unsigned char *idata, int icount)
 	int ocount;
 
 	while (icount > 0) {
-		if (oep->obuf.used == oep->obuf.len) {
+		if (abuf_used(&oep->obuf) == oep->obuf.len) {
 #ifdef DEBUG
 			logx(2, "midi%u: too slow, discarding %d bytes",
-			    oep->num, oep->obuf.used);
+			    oep->num, abuf_used(&oep->obuf));
 #endif
-			abuf_rdiscard(&oep->obuf, oep->obuf.used);
+			abuf_rdiscard(&oep->obuf, abuf_used(&oep->obuf));
 			oep->owner = NULL;
 			return;
 		}
@@ -396,6 +396,8 @@ port_omsg(void *arg, unsigned char *msg, int size)
 	struct port *p = arg;
 
 	midi_out(p->midi, msg, size);
+	if (p->state != PORT_CFG)
+		file_update(p->mio.file);
 }
 
 void
@@ -523,7 +525,7 @@ port_drain(struct port *c)
 {
 	struct midi *ep = c->midi;
 
-	if (!(ep->mode & MODE_MIDIOUT) || ep->obuf.used == 0)
+	if (!(ep->mode & MODE_MIDIOUT) || abuf_used(&ep->obuf) == 0)
 		port_close(c);
 	else {
 		c->state = PORT_DRAIN;
@@ -565,6 +567,7 @@ port_abort(struct port *p)
 		if (c != NULL && c->curval != 0) {
 			c->val_mask = ~0U;
 			c->curval = 0;
+			ctl_notify();
 		}
 	}
 	midi_abort(p->midi);
@@ -722,6 +725,7 @@ midithru_scanports(void)
 			if (c != NULL && c->curval != 0) {
 				c->val_mask = ~0U;
 				c->curval = 1;
+				ctl_notify();
 			}
 		}
 	}
@@ -70,7 +70,7 @@ port_mio_pollfd(void *addr, struct pollfd *pfd)
 
 	if (ep->mode & MODE_MIDIIN)
 		events |= POLLIN;
-	if ((ep->mode & MODE_MIDIOUT) && ep->obuf.used > 0)
+	if ((ep->mode & MODE_MIDIOUT) && abuf_used(&ep->obuf) > 0)
 		events |= POLLOUT;
 	return mio_pollfd(p->mio.hdl, pfd, events);
 }
@@ -118,7 +118,7 @@ port_mio_out(void *arg)
 		if (n < count)
 			break;
 	}
-	if (p->state == PORT_DRAIN && ep->obuf.used == 0)
+	if (p->state == PORT_DRAIN && abuf_used(&ep->obuf) == 0)
 		port_close(p);
 	midi_fill(ep);
 }
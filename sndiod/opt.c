@@ -80,7 +80,7 @@ opt_mkapp(struct opt *o, char *who)
 	 * build a bitmap of app structures currently in use
 	 */
 	inuse = 0;
-	for (i = 0, s = slot_array; i < DEV_NSLOT; i++, s++) {
+	for (s = slot_inuse_list; s != NULL; s = s->pool_next) {
 		if (s->app != NULL && s->ops != NULL)
 			inuse |= 1 << (s->app - o->app_array);
 	}
@@ -127,17 +127,17 @@ void
 opt_appvol(struct opt *o, struct app *a, int vol)
 {
 	struct slot *s;
-	int i;
 
 	a->vol = vol;
 
-	for (i = 0, s = slot_array; i < DEV_NSLOT; i++, s++) {
+	for (s = slot_inuse_list; s != NULL; s = s->pool_next) {
 		if (s->app != a || s->opt != o)
 			continue;
 		s->mix.vol = MIDI_TO_ADATA(vol);
 #ifdef DEBUG
 		logx(3, "%s/%s: setting volume %u", o->name, a->name, vol);
 #endif
+		s->ops->onvol(s->arg);
 	}
 }
 
@@ -320,7 +320,7 @@ opt_midi_dump(struct opt *o)
 struct opt *
 opt_new(struct dev *d, char *name,
     int pmin, int pmax, int rmin, int rmax,
-    int maxweight, int mmc, int dup, unsigned int mode)
+    int maxweight, int mmc, int dup, int excl, unsigned int mode)
 {
 	struct opt *o, **po;
 	char str[64];
@@ -390,15 +390,17 @@ opt_new(struct dev *d, char *name,
 	o->maxweight = maxweight;
 	o->mtc = mmc ? &mtc_array[0] : NULL;
 	o->dup = dup;
+	o->excl = excl;
 	o->mode = mode;
 	memcpy(o->name, name, len + 1);
 	opt_setalt(o, d);
 	o->next = *po;
 	*po = o;
 
-	logx(2, "%s: %s%s, vol = %d", o->name, (chans_fmt(str, sizeof(str),
+	logx(2, "%s: %s%s%s, vol = %d", o->name, (chans_fmt(str, sizeof(str),
 	    o->mode, o->pmin, o->pmax, o->rmin, o->rmax), str),
-	    (o->dup) ? ", dup" : "", o->maxweight);
+	    (o->dup) ? ", dup" : "", (o->excl) ? ", excl" : "",
+	    o->maxweight);
 
 	return o;
 }
@@ -558,7 +560,7 @@ opt_setdev(struct opt *o, struct dev *ndev)
 	}
 
 	/* check if clients can use new device */
-	for (i = 0, s = slot_array; i < DEV_NSLOT; i++, s++) {
+	for (s = slot_inuse_list; s != NULL; s = s->pool_next) {
 		if (s->opt != o)
 			continue;
 		if (s->ops != NULL && !dev_iscompat(odev, ndev)) {
@@ -584,7 +586,7 @@ opt_setdev(struct opt *o, struct dev *ndev)
 		c->curval = 0;
 
 	/* detach clients from old device */
-	for (i = 0, s = slot_array; i < DEV_NSLOT; i++, s++) {
+	for (s = slot_inuse_list; s != NULL; s = s->pool_next) {
 		if (s->opt != o)
 			continue;
 
@@ -603,17 +605,16 @@ opt_setdev(struct opt *o, struct dev *ndev)
 	if (c != NULL) {
 		c->curval = 1;
 		c->val_mask = ~0;
+		ctl_notify();
 	}
 
 	/* attach clients to new device */
-	for (i = 0, s = slot_array; i < DEV_NSLOT; i++, s++) {
+	for (s = slot_inuse_list; s != NULL; s = s->pool_next) {
 		if (s->opt != o)
 			continue;
 
-		if (s->pstate == SLOT_RUN || s->pstate == SLOT_STOP) {
-			slot_initconv(s);
+		if (s->pstate == SLOT_RUN || s->pstate == SLOT_STOP)
 			slot_attach(s);
-		}
 	}
 
 	/* move controlling clients to new device */
@@ -635,8 +636,7 @@ void
 opt_migrate(struct opt *o, struct dev *odev)
 {
 	struct opt_alt *a;
-	struct slot *s;
-	int i;
+	struct slot *s, *snext;
 
 	for (a = o->alt_list; a != NULL; a = a->next) {
 		if (a->dev == odev)
@@ -644,13 +644,13 @@ opt_migrate(struct opt *o, struct dev *odev)
 		if (opt_setdev(o, a->dev))
 			return;
 	}
-	for (i = 0, s = slot_array; i < DEV_NSLOT; i++, s++) {
+	for (s = slot_inuse_list; s != NULL; s = snext) {
+		snext = s->pool_next;
 		if (s->opt != o)
 			continue;
-		if (s->ops) {
-			s->ops->exit(s->arg);
-			s->ops = NULL;
-		}
+		s->ops->exit(s->arg);
+		if (s->ops != NULL)
+			slot_put(s);
 	}
 }
 
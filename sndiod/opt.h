@@ -51,6 +51,7 @@ struct opt {
 	int pmin, pmax;		/* play channels */
 	int rmin, rmax;		/* recording channels */
 	int dup;		/* true if join/expand enabled */
+	int excl;		/* true if exclusive passthrough enabled */
 	int mode;		/* bitmap of MODE_XXX */
 	int refcnt;
 };
@@ -70,7 +71,7 @@ void opt_midi_vol(struct opt *, struct app *);
 void opt_midi_appdesc(struct opt *o, struct app *a);
 void opt_midi_dump(struct opt *o);
 struct opt *opt_new(struct dev *, char *, int, int, int, int,
-    int, int, int, unsigned int);
+    int, int, int, int, unsigned int);
 void opt_del(struct opt *);
 void opt_setalt(struct opt *, struct dev *);
 struct opt *opt_byname(char *);
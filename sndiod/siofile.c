@@ -17,11 +17,15 @@
 #include <sys/time.h>
 #include <sys/types.h>
 
+#include <errno.h>
+#include <fcntl.h>
 #include <poll.h>
+#include <signal.h>
 #include <sndio.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "abuf.h"
 #include "defs.h"
@@ -41,6 +45,20 @@ int dev_sio_pollfd(void *, struct pollfd *);
 int dev_sio_revents(void *, struct pollfd *);
 void dev_sio_run(void *);
 void dev_sio_hup(void *);
+int dev_sio_openhdl(struct dev *);
+void dev_sio_closehdl(struct dev *);
+#ifdef USE_THREADS
+int dev_sio_thread_start(struct dev *);
+void dev_sio_thread_stop(struct dev *);
+void dev_sio_thread_wakeup(struct dev *);
+int dev_sio_pipe(int *);
+void *dev_sio_thread(void *);
+int dev_sio_notify_pollfd(void *, struct pollfd *);
+int dev_sio_notify_revents(void *, struct pollfd *);
+void dev_sio_notify_in(void *);
+void dev_sio_notify_out(void *);
+void dev_sio_notify_hup(void *);
+#endif
 
 extern struct fileops dev_sioctl_ops;
 
@@ -53,6 +71,17 @@ struct fileops dev_sio_ops = {
 	dev_sio_hup
 };
 
+#ifdef USE_THREADS
+struct fileops dev_sio_notify_ops = {
+	"sio_notify",
+	dev_sio_notify_pollfd,
+	dev_sio_notify_revents,
+	dev_sio_notify_in,
+	dev_sio_notify_out,
+	dev_sio_notify_hup
+};
+#endif
+
 void
 dev_sio_onmove(void *arg, int delta)
 {
@@ -82,8 +111,9 @@ dev_sio_onxrun(void *arg)
 #ifdef DEBUG
 	logx(1, "%s: xrun", d->path);
 #endif
+	d->nxrun++;
 	for (s = d->slot_list; s != NULL; s = s->next)
-		s->ops->onxrun(s->arg);
+		slot_notify(s, SLOT_XRUN);
 }
 
 void
@@ -97,10 +127,10 @@ dev_sio_timeout(void *arg)
 }
 
 /*
- * open the device.
+ * open the audio device, without the control device
  */
 int
-dev_sio_open(struct dev *d)
+dev_sio_openhdl(struct dev *d)
 {
 	struct sio_par par;
 	unsigned int rate, mode = SIO_PLAY | SIO_REC;
@@ -124,16 +154,13 @@ dev_sio_open(struct dev *d)
 	}
 	d->mode = mode;
 
-	d->sioctl.hdl = sioctl_open(d->path, SIOCTL_READ | SIOCTL_WRITE, 0);
-	if (d->sioctl.hdl == NULL)
-		logx(1, "%s: no control device", d->path);
-
 	sio_initpar(&par);
 	par.bits = d->par.bits;
 	par.bps = d->par.bps;
 	par.sig = d->par.sig;
 	par.le = d->par.le;
 	par.msb = d->par.msb;
+	par.flt = d->par.flt;
 	if (d->mode & SIO_PLAY)
 		par.pchan = d->pchan;
 	if (d->mode & SIO_REC)
@@ -159,6 +186,7 @@ dev_sio_open(struct dev *d)
 		par.sig = d->par.sig;
 		par.le = d->par.le;
 		par.msb = d->par.msb;
+		par.flt = d->par.flt;
 		if (mode & SIO_PLAY)
 			par.pchan = d->reqpchan;
 		if (mode & SIO_REC)
@@ -216,6 +244,7 @@ dev_sio_open(struct dev *d)
 	d->par.sig = par.sig;
 	d->par.le = par.le;
 	d->par.msb = par.msb;
+	d->par.flt = par.flt == 1;
 	if (d->mode & SIO_PLAY)
 		d->pchan = par.pchan;
 	if (d->mode & SIO_REC)
@@ -227,23 +256,53 @@ dev_sio_open(struct dev *d)
 		d->mode |= MODE_MON;
 	sio_onmove(d->sio.hdl, dev_sio_onmove, d);
 	sio_onxrun(d->sio.hdl, dev_sio_onxrun, d);
-	d->sio.file = file_new(&dev_sio_ops, d, "dev", sio_nfds(d->sio.hdl));
-	if (d->sioctl.hdl) {
-		d->sioctl.file = file_new(&dev_sioctl_ops, d, "mix",
-		    sioctl_nfds(d->sioctl.hdl));
-	}
+	if (d->thread) {
+#ifdef USE_THREADS
+		if (!dev_sio_thread_start(d))
+			goto bad_close;
+#endif
+	} else
+		d->sio.file = file_new(&dev_sio_ops, d, "dev",
+		    sio_nfds(d->sio.hdl));
 	timo_set(&d->sio.watchdog, dev_sio_timeout, d);
-	dev_sioctl_open(d);
 	return 1;
  bad_close:
 	sio_close(d->sio.hdl);
-	if (d->sioctl.hdl) {
-		sioctl_close(d->sioctl.hdl);
-		d->sioctl.hdl = NULL;
-	}
 	return 0;
 }
 
+void
+dev_sio_closehdl(struct dev *d)
+{
+	timo_del(&d->sio.watchdog);
+	if (d->thread) {
+#ifdef USE_THREADS
+		dev_sio_thread_stop(d);
+#endif
+	} else
+		file_del(d->sio.file);
+	sio_close(d->sio.hdl);
+}
+
+/*
+ * open the device.
+ */
+int
+dev_sio_open(struct dev *d)
+{
+	if (!dev_sio_openhdl(d))
+		return 0;
+	d->sioctl.hdl = sioctl_open(d->path, SIOCTL_READ | SIOCTL_WRITE, 0);
+	if (d->sioctl.hdl == NULL)
+		logx(1, "%s: no control device", d->path);
+	else {
+		d->sioctl.file = file_new(&dev_sioctl_ops, d, "mix",
+		    sioctl_nfds(d->sioctl.hdl));
+	}
+	dev_sioctl_open(d);
+	return 1;
+}
+
 void
 dev_sio_close(struct dev *d)
 {
@@ -251,9 +310,7 @@ dev_sio_close(struct dev *d)
 #ifdef DEBUG
 	logx(3, "%s: closed", d->path);
 #endif
-	timo_del(&d->sio.watchdog);
-	file_del(d->sio.file);
-	sio_close(d->sio.hdl);
+	dev_sio_closehdl(d);
 	if (d->sioctl.hdl) {
 		file_del(d->sioctl.file);
 		sioctl_close(d->sioctl.hdl);
@@ -261,6 +318,26 @@ dev_sio_close(struct dev *d)
 	}
 }
 
+/*
+ * reopen the audio device with new parameters, but keep the control
+ * device, so its controls don't disappear for control clients. If
+ * this fails, the control device is closed as well
+ */
+int
+dev_sio_reopen(struct dev *d)
+{
+	dev_sio_closehdl(d);
+	if (dev_sio_openhdl(d))
+		return 1;
+	dev_sioctl_close(d);
+	if (d->sioctl.hdl) {
+		file_del(d->sioctl.file);
+		sioctl_close(d->sioctl.hdl);
+		d->sioctl.hdl = NULL;
+	}
+	return 0;
+}
+
 void
 dev_sio_start(struct dev *d)
 {
@@ -284,7 +361,17 @@ dev_sio_start(struct dev *d)
 	d->sio.utime = file_utime;
 	logx(3, "%s: started", d->path);
 #endif
-	timo_add(&d->sio.watchdog, WATCHDOG_USEC);
+	if (d->thread) {
+#ifdef USE_THREADS
+		/*
+		 * the thread polls the watchdog itself
+		 */
+		dev_sio_thread_wakeup(d);
+#endif
+	} else {
+		file_update(d->sio.file);
+		timo_add(&d->sio.watchdog, WATCHDOG_USEC);
+	}
 }
 
 void
@@ -299,6 +386,8 @@ dev_sio_stop(struct dev *d)
 	    d->path, d->sio.sum_utime / 1000, d->sio.sum_wtime / 1000);
 #endif
 	timo_del(&d->sio.watchdog);
+	if (!d->thread)
+		file_update(d->sio.file);
 }
 
 int
@@ -378,8 +467,10 @@ dev_sio_run(void *arg)
 			d->sio.cstate = DEV_SIO_CYCLE;
 			break;
 		case DEV_SIO_CYCLE:
-			timo_del(&d->sio.watchdog);
-			timo_add(&d->sio.watchdog, WATCHDOG_USEC);
+			if (!DEV_ASYNC(d)) {
+				timo_del(&d->sio.watchdog);
+				timo_add(&d->sio.watchdog, WATCHDOG_USEC);
+			}
 
 #ifdef DEBUG
 			/*
@@ -460,3 +551,220 @@ dev_sio_hup(void *arg)
 	dev_migrate(d);
 	dev_abort(d);
 }
+
+#ifdef USE_THREADS
+/*
+ * Device thread: poll the device and run its cycles. The daemon state
+ * is only touched with the read lock held, so device threads run
+ * in parallel with each other, but never while the main loop is
+ * processing events. Slot client notifications can't be delivered
+ * from here, they are queued by slot_notify() and the main loop is
+ * woken up through the notify pipe to deliver them.
+ */
+void *
+dev_sio_thread(void *arg)
+{
+	struct dev *d = arg;
+	struct pollfd *pfds;
+	unsigned char buf[32];
+	int nfds, revents, res;
+
+	pfds = xmalloc((sio_nfds(d->sio.hdl) + 1) * sizeof(struct pollfd));
+
+	file_rdlock();
+	while (!d->sio.quit) {
+		nfds = 0;
+		if (d->pstate == DEV_RUN && !d->sio.hup)
+			nfds = dev_sio_pollfd(d, pfds);
+		pfds[nfds].fd = d->sio.wakefd[0];
+		pfds[nfds].events = POLLIN;
+
+		pthread_rwlock_unlock(&file_lock);
+		res = poll(pfds, nfds + 1, WATCHDOG_USEC / 1000);
+		file_rdlock();
+
+		if (res == -1) {
+			if (errno != EINTR) {
+				logx(0, "%s: poll failed", d->path);
+				panic();
+			}
+			continue;
+		}
+		if (pfds[nfds].revents & POLLIN) {
+			while (read(d->sio.wakefd[0], buf, sizeof(buf)) > 0)
+				;
+		}
+		if (nfds == 0 || d->pstate != DEV_RUN)
+			continue;
+		if (res == 0) {
+			logx(1, "%s: watchdog timeout", d->path);
+			continue;
+		}
+
+		d->sio.async = 1;
+		revents = dev_sio_revents(d, pfds);
+		if (revents & POLLHUP) {
+			d->sio.hup = 1;
+			d->sio.pending = 1;
+		} else if (revents & (POLLIN | POLLOUT))
+			dev_sio_run(d);
+		d->sio.async = 0;
+
+		if (d->sio.pending) {
+			d->sio.pending = 0;
+			write(d->sio.notifyfd[1], buf, 1);
+		}
+	}
+	pthread_rwlock_unlock(&file_lock);
+
+	xfree(pfds);
+	return NULL;
+}
+
+/*
+ * make the device thread reevaluate its poll(2) conditions
+ */
+void
+dev_sio_thread_wakeup(struct dev *d)
+{
+	unsigned char c = 0;
+
+	write(d->sio.wakefd[1], &c, 1);
+}
+
+/*
+ * create a non-blocking pipe
+ */
+int
+dev_sio_pipe(int *fds)
+{
+	if (pipe(fds) == -1)
+		return 0;
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+	fcntl(fds[1], F_SETFL, O_NONBLOCK);
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+	return 1;
+}
+
+int
+dev_sio_thread_start(struct dev *d)
+{
+	struct sched_param sp;
+	sigset_t set, oset;
+	int err;
+
+	if (!dev_sio_pipe(d->sio.wakefd)) {
+		logx(1, "%s: failed to create pipe", d->path);
+		return 0;
+	}
+	if (!dev_sio_pipe(d->sio.notifyfd)) {
+		logx(1, "%s: failed to create pipe", d->path);
+		goto bad_wake;
+	}
+	d->sio.notify = file_new(&dev_sio_notify_ops, d, "dev", 1);
+	if (d->sio.notify == NULL)
+		goto bad_notify;
+	d->sio.async = 0;
+	d->sio.quit = 0;
+	d->sio.hup = 0;
+	d->sio.idle = 0;
+	d->sio.mtcdelta = 0;
+	d->sio.pending = 0;
+
+	/*
+	 * signals are handled by the main loop only
+	 */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &oset);
+	err = pthread_create(&d->sio.thread, NULL, dev_sio_thread, d);
+	pthread_sigmask(SIG_SETMASK, &oset, NULL);
+	if (err != 0) {
+		logx(1, "%s: failed to create thread", d->path);
+		goto bad_file;
+	}
+
+	sp.sched_priority = (dev_rtprio > 0) ?
+	    dev_rtprio : sched_get_priority_min(SCHED_FIFO);
+	err = pthread_setschedparam(d->sio.thread, SCHED_FIFO, &sp);
+	if (err != 0) {
+		logx(dev_rtprio > 0 ? 0 : 2,
+		    "%s: couldn't use real-time scheduling", d->path);
+	}
+	logx(3, "%s: thread started", d->path);
+	return 1;
+bad_file:
+	file_del(d->sio.notify);
+bad_notify:
+	close(d->sio.notifyfd[0]);
+	close(d->sio.notifyfd[1]);
+bad_wake:
+	close(d->sio.wakefd[0]);
+	close(d->sio.wakefd[1]);
+	return 0;
+}
+
+void
+dev_sio_thread_stop(struct dev *d)
+{
+	/*
+	 * release the lock to let the thread notice it must exit,
+	 * other device threads don't touch this device
+	 */
+	d->sio.quit = 1;
+	dev_sio_thread_wakeup(d);
+	pthread_rwlock_unlock(&file_lock);
+	pthread_join(d->sio.thread, NULL);
+	pthread_rwlock_wrlock(&file_lock);
+	logx(3, "%s: thread stopped", d->path);
+
+	file_del(d->sio.notify);
+	close(d->sio.notifyfd[0]);
+	close(d->sio.notifyfd[1]);
+	close(d->sio.wakefd[0]);
+	close(d->sio.wakefd[1]);
+}
+
+int
+dev_sio_notify_pollfd(void *arg, struct pollfd *pfd)
+{
+	struct dev *d = arg;
+
+	pfd->fd = d->sio.notifyfd[0];
+	pfd->events = POLLIN;
+	return 1;
+}
+
+int
+dev_sio_notify_revents(void *arg, struct pollfd *pfd)
+{
+	return pfd->revents;
+}
+
+void
+dev_sio_notify_in(void *arg)
+{
+	struct dev *d = arg;
+	unsigned char buf[32];
+
+	while (read(d->sio.notifyfd[0], buf, sizeof(buf)) > 0)
+		;
+	dev_notify(d);
+	if (d->sio.hup)
+		dev_sio_hup(d);
+}
+
+void
+dev_sio_notify_out(void *arg)
+{
+}
+
+void
+dev_sio_notify_hup(void *arg)
+{
+	struct dev *d = arg;
+
+	logx(0, "%s: notify pipe closed", d->path);
+	panic();
+}
+#endif
@@ -35,10 +35,26 @@ struct dev_sio {
 #define DEV_SIO_WRITE	2
 	int cstate;
 	struct timo watchdog;
+#ifdef USE_THREADS
+	pthread_t thread;			/* device thread */
+	int async;				/* true in the device thread */
+	int quit;				/* ask the thread to exit */
+	int hup;				/* device disconnected */
+	int idle;				/* device not used anymore */
+	int mtcdelta;				/* ticks not sent as MTC */
+	int pending;				/* main thread must be woken */
+	int wakefd[2];				/* to wake up the thread */
+	int notifyfd[2];			/* to wake up the main thread */
+	struct file *notify;			/* notifyfd in the main loop */
+#define DEV_ASYNC(d)	((d)->sio.async)
+#else
+#define DEV_ASYNC(d)	0
+#endif
 };
 
 int dev_sio_open(struct dev *);
 void dev_sio_close(struct dev *);
+int dev_sio_reopen(struct dev *);
 void dev_sio_start(struct dev *);
 void dev_sio_stop(struct dev *);
 
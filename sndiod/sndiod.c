@@ -16,6 +16,7 @@
  */
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <sys/resource.h>
 #include <sys/socket.h>
 
@@ -25,11 +26,13 @@
 #include <grp.h>
 #include <limits.h>
 #include <pwd.h>
+#include <sched.h>
 #include <signal.h>
 #include <sndio.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <syslog.h>
 #include <unistd.h>
 
 #include "amsg.h"
@@ -41,6 +44,7 @@
 #include "opt.h"
 #include "sock.h"
 #include "utils.h"
+#include "worker.h"
 #include "bsd-compat.h"
 
 /*
@@ -87,6 +91,7 @@
 
 void sigint(int);
 void sighup(int);
+void sigusr1(int);
 void opt_ch(int *, int *);
 void opt_enc(struct aparams *);
 int opt_mmc(void);
@@ -96,19 +101,22 @@ unsigned int opt_mode(void);
 void getbasepath(char *);
 void setsig(void);
 void unsetsig(void);
-struct dev *mkdev(char *, struct aparams *, int, int);
+void setrt(int);
+void setnofile(void);
+struct dev *mkdev(char *, struct aparams *, int, int, int);
 struct port *mkport(char *, int);
 struct opt *mkopt(char *, struct dev *, struct opt_alt *,
-    int, int, int, int, int, int, int, int);
+    int, int, int, int, int, int, int, int, int);
 
 unsigned int log_level = 0;
-volatile sig_atomic_t quit_flag = 0, reopen_flag = 0;
+volatile sig_atomic_t quit_flag = 0, reopen_flag = 0, stats_flag = 0;
 
 char usagestr[] = "usage: sndiod [-d] [-a flag] [-b nframes] "
     "[-C min:max] [-c min:max]\n\t"
-    "[-e enc] [-F device] [-f device] [-j flag] [-L addr] [-m mode]\n\t"
-    "[-Q port] [-q port] [-r rate] [-s name] [-t mode] [-U unit]\n\t"
-    "[-v volume] [-w flag] [-z nframes]\n";
+    "[-E flag] [-e enc] [-F device] [-f device] [-j flag] [-L addr]\n\t"
+    "[-M kbytes] [-m mode] [-N nstreams] [-P nthreads] [-Q port]\n\t"
+    "[-q port] [-R prio] [-r rate] [-s name] [-T flag] [-t mode]\n\t"
+    "[-U unit] [-v volume] [-w flag] [-z nframes]\n";
 
 /*
  * default audio devices
@@ -154,6 +162,16 @@ sighup(int s)
 	reopen_flag = 1;
 }
 
+/*
+ * SIGUSR1 handler, it raises the stats flag, which requests device
+ * statistics to be logged.
+ */
+void
+sigusr1(int s)
+{
+	stats_flag = 1;
+}
+
 void
 opt_ch(int *rcmin, int *rcmax)
 {
@@ -291,6 +309,7 @@ setsig(void)
 
 	quit_flag = 0;
 	reopen_flag = 0;
+	stats_flag = 0;
 	sigfillset(&sa.sa_mask);
 	sa.sa_flags = SA_RESTART;
 	sa.sa_handler = sigint;
@@ -301,6 +320,61 @@ setsig(void)
 	sa.sa_handler = sighup;
 	if (sigaction(SIGHUP, &sa, NULL) == -1)
 		err(1, "sigaction(hup) failed");
+	sa.sa_handler = sigusr1;
+	if (sigaction(SIGUSR1, &sa, NULL) == -1)
+		err(1, "sigaction(usr1) failed");
+}
+
+/*
+ * raise the descriptor limit to the maximum, as each client uses one
+ */
+void
+setnofile(void)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == -1 || rl.rlim_cur == rl.rlim_max)
+		return;
+	rl.rlim_cur = rl.rlim_max;
+	if (setrlimit(RLIMIT_NOFILE, &rl) == -1)
+		logx(0, "couldn't raise the descriptor limit");
+}
+
+/*
+ * lock memory and switch to real-time scheduling; on failure, log
+ * and continue with normal scheduling. It runs after daemon(3), so
+ * failures are logged at level 0 to reach syslog.
+ */
+void
+setrt(int prio)
+{
+#if _POSIX_PRIORITY_SCHEDULING > 0
+	struct sched_param sp;
+#endif
+	struct rlimit rl;
+	int flags;
+
+	/*
+	 * once privileges are dropped, memory allocated later counts
+	 * against the locked memory limit, so remove it. If we can't,
+	 * lock only the current memory, the buffers allocated later
+	 * are touched as they are allocated
+	 */
+	flags = MCL_CURRENT | MCL_FUTURE;
+	rl.rlim_cur = rl.rlim_max = RLIM_INFINITY;
+	if (setrlimit(RLIMIT_MEMLOCK, &rl) == -1)
+		flags = MCL_CURRENT;
+	if (mlockall(flags) == -1)
+		logx(0, "couldn't lock memory: %s", strerror(errno));
+#if _POSIX_PRIORITY_SCHEDULING > 0
+	sp.sched_priority = prio;
+	if (sched_setscheduler(0, SCHED_FIFO, &sp) == -1) {
+		logx(0, "couldn't use real-time priority %d: %s",
+		    prio, strerror(errno));
+	}
+#else
+	logx(0, "real-time scheduling not supported");
+#endif
 }
 
 void
@@ -311,6 +385,8 @@ unsetsig(void)
 	sigfillset(&sa.sa_mask);
 	sa.sa_flags = SA_RESTART;
 	sa.sa_handler = SIG_DFL;
+	if (sigaction(SIGUSR1, &sa, NULL) == -1)
+		err(1, "unsetsig(usr1): sigaction failed");
 	if (sigaction(SIGHUP, &sa, NULL) == -1)
 		err(1, "unsetsig(hup): sigaction failed");
 	if (sigaction(SIGTERM, &sa, NULL) == -1)
@@ -320,7 +396,8 @@ unsetsig(void)
 }
 
 struct dev *
-mkdev(char *path, struct aparams *par, int hold, int autovol)
+mkdev(char *path, struct aparams *par,
+    int hold, int autovol, int thread)
 {
 	struct dev *d;
 
@@ -328,7 +405,7 @@ mkdev(char *path, struct aparams *par, int hold, int autovol)
 		if (strcmp(d->path, path) == 0)
 			return d;
 	}
-	d = dev_new(path, par, hold, autovol);
+	d = dev_new(path, par, hold, autovol, thread);
 	if (d == NULL)
 		exit(1);
 	return d;
@@ -352,13 +429,13 @@ mkport(char *path, int hold)
 struct opt *
 mkopt(char *path, struct dev *d, struct opt_alt *alt_list,
     int pmin, int pmax, int rmin, int rmax,
-    int mode, int vol, int mmc, int dup)
+    int mode, int vol, int mmc, int dup, int excl)
 {
 	struct opt *o;
 	struct opt_alt *a;
 
 	o = opt_new(d, path, pmin, pmax, rmin, rmax,
-	    MIDI_TO_ADATA(vol), mmc, dup, mode);
+	    MIDI_TO_ADATA(vol), mmc, dup, excl, mode);
 	if (o == NULL)
 		return NULL;
 	dev_adjpar(d, o->pmax, o->rmax);
@@ -372,8 +449,8 @@ main(int argc, char **argv)
 {
 	int c, i, background, unit;
 	int pmin, pmax, rmin, rmax;
-	unsigned int mode, dup, mmc, vol;
-	unsigned int hold, autovol;
+	unsigned int mode, dup, excl, mmc, vol;
+	unsigned int hold, autovol, thread, nworkers, rtprio;
 	const char *str;
 	struct aparams par;
 	struct opt *o;
@@ -395,9 +472,13 @@ main(int argc, char **argv)
 	dev_rate = DEFAULT_RATE;
 	vol = 127;
 	dup = 1;
+	excl = 0;
 	mmc = 0;
 	hold = 0;
 	autovol = 0;
+	thread = 0;
+	nworkers = 0;
+	rtprio = 0;
 	unit = 0;
 	background = 1;
 	pmin = 0;
@@ -409,6 +490,7 @@ main(int argc, char **argv)
 	par.le = ADATA_LE;
 	par.sig = 1;
 	par.msb = 0;
+	par.flt = 0;
 	mode = MODE_PLAY | MODE_REC;
 	alt_list = NULL;
 	tcpaddr_list = NULL;
@@ -416,7 +498,7 @@ main(int argc, char **argv)
 	p = NULL;
 
 	while ((c = getopt(argc, argv,
-	    "a:b:c:C:de:F:f:j:L:m:Q:q:r:s:t:U:v:w:x:z:")) != -1) {
+	    "a:b:c:C:dE:e:F:f:j:L:M:m:N:P:Q:q:R:r:s:T:t:U:v:w:x:z:")) != -1) {
 		switch (c) {
 		case 'd':
 			log_level++;
@@ -439,6 +521,9 @@ main(int argc, char **argv)
 		case 'j':
 			dup = opt_onoff();
 			break;
+		case 'E':
+			excl = opt_onoff();
+			break;
 		case 't':
 			mmc = opt_mmc();
 			break;
@@ -464,12 +549,13 @@ main(int argc, char **argv)
 		case 's':
 			if (d == NULL) {
 				for (i = 0; default_devs[i] != NULL; i++) {
-					mkdev(default_devs[i], &par, 0, autovol);
+					mkdev(default_devs[i], &par, 0,
+					    autovol, thread);
 				}
 				d = dev_list;
 			}
 			if (mkopt(optarg, d, alt_list, pmin, pmax, rmin, rmax,
-				mode, vol, mmc, dup) == NULL)
+				mode, vol, mmc, dup, excl) == NULL)
 				return 1;
 			break;
 		case 'q':
@@ -482,6 +568,40 @@ main(int argc, char **argv)
 		case 'w':
 			autovol = opt_onoff();
 			break;
+		case 'T':
+			thread = opt_onoff();
+#ifndef USE_THREADS
+			if (thread)
+				errx(1, "-T: threads not supported");
+#endif
+			break;
+		case 'R':
+			rtprio = strtonum(optarg, 0, 99, &str);
+			if (str)
+				errx(1, "%s: priority is %s", optarg, str);
+			break;
+		case 'M':
+			xbuf_max = (size_t)strtonum(optarg, 0, 1024 * 1024,
+			    &str) * 1024;
+			if (str)
+				errx(1, "%s: memory size is %s", optarg, str);
+			break;
+		case 'N':
+			slot_max = strtonum(optarg, 1, SLOT_NMAX, &str);
+			if (str)
+				errx(1, "%s: number of streams is %s",
+				    optarg, str);
+			break;
+		case 'P':
+			nworkers = strtonum(optarg, 0, WORKER_NMAX, &str);
+			if (str)
+				errx(1, "%s: number of threads is %s",
+				    optarg, str);
+#ifndef USE_THREADS
+			if (nworkers > 0)
+				errx(1, "-P: threads not supported");
+#endif
+			break;
 		case 'b':
 			dev_bufsz = strtonum(optarg, 1, RATE_MAX, &str);
 			if (str)
@@ -493,7 +613,7 @@ main(int argc, char **argv)
 				errx(1, "%s: block size is %s", optarg, str);
 			break;
 		case 'f':
-			d = mkdev(optarg, &par, hold, autovol);
+			d = mkdev(optarg, &par, hold, autovol, thread);
 			while ((a = alt_list) != NULL) {
 				alt_list = a->next;
 				xfree(a);
@@ -503,7 +623,7 @@ main(int argc, char **argv)
 			if (d == NULL)
 				errx(1, "-F %s: no devices defined", optarg);
 			a = xmalloc(sizeof(struct opt_alt));
-			a->dev = mkdev(optarg, &par, hold, autovol);
+			a->dev = mkdev(optarg, &par, hold, autovol, thread);
 			for (pa = &alt_list; *pa != NULL; pa = &(*pa)->next)
 				;
 			a->next = NULL;
@@ -520,6 +640,7 @@ main(int argc, char **argv)
 		fputs(usagestr, stderr);
 		return 1;
 	}
+	dev_rtprio = rtprio;
 
 	if (!dev_bufsz && !dev_round) {
 		dev_round = DEFAULT_ROUND;
@@ -542,7 +663,7 @@ main(int argc, char **argv)
 	}
 	if (dev_list == NULL) {
 		for (i = 0; default_devs[i] != NULL; i++) {
-			mkdev(default_devs[i], &par, 0, autovol);
+			mkdev(default_devs[i], &par, 0, autovol, thread);
 		}
 	}
 
@@ -552,7 +673,7 @@ main(int argc, char **argv)
 	o = opt_byname("default");
 	if (o == NULL) {
 		o = mkopt("default", dev_list, alt_list, pmin, pmax, rmin, rmax,
-		    mode, vol, 0, dup);
+		    mode, vol, 0, dup, excl);
 		if (o == NULL)
 			return 1;
 	}
@@ -563,7 +684,8 @@ main(int argc, char **argv)
 	 */
 	for (d = dev_list; d != NULL; d = d->next) {
 		if (opt_new(d, NULL, o->pmin, o->pmax, o->rmin, o->rmax,
-			o->maxweight, o->mtc != NULL, o->dup, o->mode) == NULL)
+			o->maxweight, o->mtc != NULL, o->dup, o->excl,
+			o->mode) == NULL)
 			return 1;
 		dev_adjpar(d, o->pmax, o->rmax);
 	}
@@ -574,7 +696,9 @@ main(int argc, char **argv)
 	}
 
 	setsig();
+	setnofile();
 	filelist_init();
+	dsp_init();
 
 	if (geteuid() == 0) {
 		if ((pw = getpwnam(SNDIO_USER)) == NULL)
@@ -596,18 +720,38 @@ main(int argc, char **argv)
 		if (!port_init(p))
 			return 1;
 	}
-	for (d = dev_list; d != NULL; d = d->next) {
-		if (!dev_init(d))
-			return 1;
-	}
-	for (o = opt_list; o != NULL; o = o->next)
-		opt_init(o);
 	if (background) {
 		log_flush();
 		log_level = 0;
 		if (daemon(0, 0) == -1)
 			err(1, "daemon");
+		openlog("sndiod", LOG_PID, LOG_DAEMON);
+		log_syslog = 1;
 	}
+	/*
+	 * memory locks and threads don't survive daemon(3), so set them
+	 * up now, while we're still allowed to use real-time scheduling
+	 */
+	if (rtprio > 0)
+		setrt(rtprio);
+#ifdef USE_THREADS
+	filelist_initlock();
+	if (nworkers > 0 && !worker_init(nworkers, rtprio))
+		return 1;
+#endif
+
+	/*
+	 * device threads are started when held devices are opened, so
+	 * this must be done after daemon(3) as well
+	 */
+	for (d = dev_list; d != NULL; d = d->next) {
+		if (!dev_init(d)) {
+			logx(0, "%s: couldn't open device", d->path);
+			return 1;
+		}
+	}
+	for (o = opt_list; o != NULL; o = o->next)
+		opt_init(o);
 	if (pw != NULL) {
 		if (setpriority(PRIO_PROCESS, 0, SNDIO_PRIO) == -1)
 			err(1, "setpriority");
@@ -625,6 +769,11 @@ main(int argc, char **argv)
 			reopen_devs();
 			midithru_scanports();
 		}
+		if (stats_flag) {
+			stats_flag = 0;
+			for (d = dev_list; d != NULL; d = d->next)
+				dev_logstats(d);
+		}
 		if (!file_poll())
 			break;
 	}
@@ -653,6 +802,10 @@ main(int argc, char **argv)
 		tcpaddr_list = ta->next;
 		xfree(ta);
 	}
+#ifdef USE_THREADS
+	worker_done();
+#endif
+	xbuf_done();
 	filelist_done();
 	unsetsig();
 	return 0;
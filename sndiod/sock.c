@@ -16,6 +16,7 @@
  */
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <errno.h>
 #include <poll.h>
@@ -47,16 +48,21 @@ void sock_midi_imsg(void *, unsigned char *, int);
 void sock_midi_omsg(void *, unsigned char *, int);
 void sock_midi_fill(void *, int);
 void sock_ctl_sync(void *);
+void sock_ctl_onctl(void *);
 struct sock *sock_new(int);
 void sock_exit(void *);
-int sock_fdwrite(struct sock *, void *, int);
-int sock_fdread(struct sock *, void *, int);
+int sock_fdwritev(struct sock *, struct iovec *, int);
+int sock_fdreadv(struct sock *, struct iovec *, int);
+int sock_iovtrunc(struct iovec *, int, int);
+int sock_wdatavec(struct sock *, struct iovec *, int);
+void sock_wcommit(struct sock *, int);
 int sock_rmsg(struct sock *);
 int sock_wmsg(struct sock *);
 int sock_rdata(struct sock *);
 int sock_wdata(struct sock *);
 int sock_setpar(struct sock *);
 int sock_auth(struct sock *);
+unsigned int sock_datamax(void);
 int sock_hello(struct sock *);
 int sock_execmsg(struct sock *);
 int sock_buildmsg(struct sock *);
@@ -96,7 +102,8 @@ struct midiops sock_midiops = {
 
 struct ctlops sock_ctlops = {
 	sock_exit,
-	sock_ctl_sync
+	sock_ctl_sync,
+	sock_ctl_onctl
 };
 
 struct sock *sock_list = NULL;
@@ -205,9 +212,10 @@ sock_slot_fill(void *arg)
 
 	f->fillpending += s->round;
 #ifdef DEBUG
-	logx(4, "slot%zu: fill, rmax -> %d, pending -> %d",
-	    s - slot_array, f->rmax, f->fillpending);
+	logx(4, "slot%u: fill, rmax -> %d, pending -> %d",
+	    s->num, f->rmax, f->fillpending);
 #endif
+	file_update(f->file);
 }
 
 void
@@ -218,8 +226,9 @@ sock_slot_flush(void *arg)
 
 	f->wmax += s->round * s->sub.bpf;
 #ifdef DEBUG
-	logx(4, "slot%zu: flush, wmax -> %d", s - slot_array, f->wmax);
+	logx(4, "slot%u: flush, wmax -> %d", s->num, f->wmax);
 #endif
+	file_update(f->file);
 }
 
 void
@@ -229,9 +238,10 @@ sock_slot_eof(void *arg)
 #ifdef DEBUG
 	struct slot *s = f->slot;
 
-	logx(3, "slot%zu: eof", s - slot_array);
+	logx(3, "slot%u: eof", s->num);
 #endif
 	f->stoppending = 1;
+	file_update(f->file);
 }
 
 void
@@ -241,11 +251,12 @@ sock_slot_onmove(void *arg)
 	struct slot *s = f->slot;
 
 #ifdef DEBUG
-	logx(4, "slot%zu: onmove: delta -> %d", s - slot_array, s->delta);
+	logx(4, "slot%u: onmove: delta -> %d", s->num, s->delta);
 #endif
 	if (s->pstate != SOCK_START)
 		return;
 	f->tickpending++;
+	file_update(f->file);
 }
 
 void
@@ -255,25 +266,26 @@ sock_slot_onxrun(void *arg)
 	struct slot *s = f->slot;
 
 #ifdef DEBUG
-	logx(4, "slot%zu: onxrun: notify = %d", s - slot_array, f->xrunnotify);
+	logx(4, "slot%u: onxrun: notify = %d", s->num, f->xrunnotify);
 #endif
 	if (s->pstate != SOCK_START)
 		return;
-	if (f->xrunnotify)
+	if (f->xrunnotify) {
 		f->xrunpending = 1;
+		file_update(f->file);
+	}
 }
 
 void
 sock_slot_onvol(void *arg)
 {
 	struct sock *f = (struct sock *)arg;
+#ifdef DEBUG
 	struct slot *s = f->slot;
 
-#ifdef DEBUG
-	logx(4, "slot%zu: onvol: vol -> %u", s - slot_array, s->app->vol);
+	logx(4, "slot%u: onvol: vol -> %u", s->num, s->app->vol);
 #endif
-	if (s->pstate != SOCK_START)
-		return;
+	file_update(f->file);
 }
 
 void
@@ -290,6 +302,7 @@ sock_midi_omsg(void *arg, unsigned char *msg, int size)
 	struct sock *f = arg;
 
 	midi_out(f->midi, msg, size);
+	file_update(f->file);
 }
 
 void
@@ -298,6 +311,7 @@ sock_midi_fill(void *arg, int count)
 	struct sock *f = arg;
 
 	f->fillpending += count;
+	file_update(f->file);
 }
 
 void
@@ -307,6 +321,16 @@ sock_ctl_sync(void *arg)
 
 	if (f->ctlops & SOCK_CTLDESC)
 		f->ctlsyncpending = 1;
+	file_update(f->file);
+}
+
+void
+sock_ctl_onctl(void *arg)
+{
+	struct sock *f = arg;
+
+	if (f->ctlops)
+		file_update(f->file);
 }
 
 struct sock *
@@ -331,6 +355,7 @@ sock_new(int fd)
 	f->rstate = SOCK_RMSG;
 	f->rtodo = sizeof(struct amsg);
 	f->wmax = f->rmax = 0;
+	f->datamax = AMSG_DATAMAX;
 	f->lastvol = -1;
 	f->xrunnotify = 0;
 	f->ctlops = 0;
@@ -358,14 +383,14 @@ sock_exit(void *arg)
 }
 
 /*
- * write on the socket fd and handle errors
+ * write the given blocks on the socket fd and handle errors
  */
 int
-sock_fdwrite(struct sock *f, void *data, int count)
+sock_fdwritev(struct sock *f, struct iovec *iov, int niov)
 {
 	int n;
 
-	n = write(f->fd, data, count);
+	n = writev(f->fd, iov, niov);
 	if (n == -1) {
 #ifdef DEBUG
 		if (errno == EFAULT) {
@@ -391,14 +416,14 @@ sock_fdwrite(struct sock *f, void *data, int count)
 }
 
 /*
- * read from the socket fd and handle errors
+ * read from the socket fd into the given blocks and handle errors
  */
 int
-sock_fdread(struct sock *f, void *data, int count)
+sock_fdreadv(struct sock *f, struct iovec *iov, int niov)
 {
 	int n;
 
-	n = read(f->fd, data, count);
+	n = readv(f->fd, iov, niov);
 	if (n == -1) {
 #ifdef DEBUG
 		if (errno == EFAULT) {
@@ -423,14 +448,31 @@ sock_fdread(struct sock *f, void *data, int count)
 	return n;
 }
 
+/*
+ * truncate the given blocks to 'todo' bytes, return the number of
+ * blocks left
+ */
+int
+sock_iovtrunc(struct iovec *iov, int niov, int todo)
+{
+	int i;
+
+	for (i = 0; i < niov && todo > 0; i++) {
+		if (iov[i].iov_len > todo)
+			iov[i].iov_len = todo;
+		todo -= iov[i].iov_len;
+	}
+	return i;
+}
+
 /*
  * read the next message into f->rmsg, return 1 on success
  */
 int
 sock_rmsg(struct sock *f)
 {
+	struct iovec iov;
 	int n;
-	char *data;
 
 #ifdef DEBUG
 	if (f->rtodo == 0) {
@@ -438,8 +480,9 @@ sock_rmsg(struct sock *f)
 		panic();
 	}
 #endif
-	data = (char *)&f->rmsg + sizeof(struct amsg) - f->rtodo;
-	n = sock_fdread(f, data, f->rtodo);
+	iov.iov_base = (char *)&f->rmsg + sizeof(struct amsg) - f->rtodo;
+	iov.iov_len = f->rtodo;
+	n = sock_fdreadv(f, &iov, 1);
 	if (n == 0)
 		return 0;
 	if (n < f->rtodo) {
@@ -454,13 +497,14 @@ sock_rmsg(struct sock *f)
 }
 
 /*
- * write the message in f->rmsg, return 1 on success
+ * write the message in f->wmsg, return 1 on success. If it's a data
+ * message, the data block is written in the same system call
  */
 int
 sock_wmsg(struct sock *f)
 {
-	int n;
-	char *data;
+	struct iovec iov[3];
+	int n, niov;
 
 #ifdef DEBUG
 	if (f->wtodo == 0) {
@@ -468,18 +512,29 @@ sock_wmsg(struct sock *f)
 		/* XXX: this is fatal and we should exit here */
 	}
 #endif
-	data = (char *)&f->wmsg + sizeof(struct amsg) - f->wtodo;
-	n = sock_fdwrite(f, data, f->wtodo);
+	iov[0].iov_base = (char *)&f->wmsg + sizeof(struct amsg) - f->wtodo;
+	iov[0].iov_len = f->wtodo;
+	niov = 1;
+	if (ntohl(f->wmsg.cmd) == AMSG_DATA) {
+		f->wsize = ntohl(f->wmsg.u.data.size);
+		niov += sock_wdatavec(f, iov + 1, f->wsize);
+	}
+	n = sock_fdwritev(f, iov, niov);
 	if (n == 0)
 		return 0;
 	if (n < f->wtodo) {
 		f->wtodo -= n;
 		return 0;
 	}
+	n -= f->wtodo;
 	f->wtodo = 0;
 #ifdef DEBUG
 	logx(4, "sock %d: wrote full message", f->fd);
 #endif
+	if (ntohl(f->wmsg.cmd) == AMSG_DATA) {
+		f->wtodo = f->wsize;
+		sock_wcommit(f, n);
+	}
 	return 1;
 }
 
@@ -490,8 +545,8 @@ int
 sock_rdata(struct sock *f)
 {
 	unsigned char midibuf[MIDI_BUFSZ];
-	unsigned char *data;
-	int n, count;
+	struct iovec iov[2];
+	int n, niov;
 
 #ifdef DEBUG
 	if (f->rtodo == 0) {
@@ -501,14 +556,14 @@ sock_rdata(struct sock *f)
 #endif
 	while (f->rtodo > 0) {
 		if (f->slot)
-			data = abuf_wgetblk(&f->slot->mix.buf, &count);
+			niov = abuf_wgetvec(&f->slot->mix.buf, iov);
 		else {
-			data = midibuf;
-			count = MIDI_BUFSZ;
+			iov[0].iov_base = midibuf;
+			iov[0].iov_len = MIDI_BUFSZ;
+			niov = 1;
 		}
-		if (count > f->rtodo)
-			count = f->rtodo;
-		n = sock_fdread(f, data, count);
+		niov = sock_iovtrunc(iov, niov, f->rtodo);
+		n = sock_fdreadv(f, iov, niov);
 		if (n == 0)
 			return 0;
 		f->rtodo -= n;
@@ -525,15 +580,61 @@ sock_rdata(struct sock *f)
 	return 1;
 }
 
+/*
+ * describe the next 'todo' bytes of the data block being written,
+ * return the number of blocks
+ */
+int
+sock_wdatavec(struct sock *f, struct iovec *iov, int todo)
+{
+	static unsigned char dummy[AMSG_DATAMAX];
+	int niov;
+
+	if (f->pstate == SOCK_STOP) {
+		iov[0].iov_base = dummy;
+		iov[0].iov_len = todo < sizeof(dummy) ? todo : sizeof(dummy);
+		return 1;
+	}
+
+	/*
+	 * f->slot and f->midi are set by sock_hello(), so
+	 * the block is always properly initialized
+	 */
+	if (f->slot)
+		niov = abuf_rgetvec(&f->slot->sub.buf, iov);
+	else if (f->midi)
+		niov = abuf_rgetvec(&f->midi->obuf, iov);
+	else {
+		iov[0].iov_base = f->ctldesc + (f->wsize - todo);
+		iov[0].iov_len = todo;
+		return 1;
+	}
+	return sock_iovtrunc(iov, niov, todo);
+}
+
+/*
+ * consume 'n' bytes of the data block being written
+ */
+void
+sock_wcommit(struct sock *f, int n)
+{
+	f->wtodo -= n;
+	if (f->pstate == SOCK_STOP)
+		return;
+	if (f->slot)
+		abuf_rdiscard(&f->slot->sub.buf, n);
+	else if (f->midi)
+		abuf_rdiscard(&f->midi->obuf, n);
+}
+
 /*
  * write data to the slot/midi ring buffer
  */
 int
 sock_wdata(struct sock *f)
 {
-	static unsigned char dummy[AMSG_DATAMAX];
-	unsigned char *data = NULL;
-	int n, count;
+	struct iovec iov[2];
+	int n, niov;
 
 #ifdef DEBUG
 	if (f->wtodo == 0) {
@@ -541,46 +642,13 @@ sock_wdata(struct sock *f)
 		panic();
 	}
 #endif
-	if (f->pstate == SOCK_STOP) {
-		while (f->wtodo > 0) {
-			n = sock_fdwrite(f, dummy, f->wtodo);
-			if (n == 0)
-				return 0;
-			f->wtodo -= n;
-		}
-#ifdef DEBUG
-		logx(4, "sock %d: zero-filled remaining block", f->fd);
-#endif
-		return 1;
-	}
 	while (f->wtodo > 0) {
-		/*
-		 * f->slot and f->midi are set by sock_hello(), so
-		 * count is always properly initialized
-		 */
-		if (f->slot)
-			data = abuf_rgetblk(&f->slot->sub.buf, &count);
-		else if (f->midi)
-			data = abuf_rgetblk(&f->midi->obuf, &count);
-		else {
-			data = f->ctldesc + (f->wsize - f->wtodo);
-			count = f->wtodo;
-		}
-		if (count > f->wtodo)
-			count = f->wtodo;
-		n = sock_fdwrite(f, data, count);
+		niov = sock_wdatavec(f, iov, f->wtodo);
+		n = sock_fdwritev(f, iov, niov);
 		if (n == 0)
 			return 0;
-		f->wtodo -= n;
-		if (f->slot)
-			abuf_rdiscard(&f->slot->sub.buf, n);
-		else if (f->midi)
-			abuf_rdiscard(&f->midi->obuf, n);
+		sock_wcommit(f, n);
 	}
-	if (f->slot)
-		slot_read(f->slot);
-	if (f->midi)
-		midi_fill(f->midi);
 #ifdef DEBUG
 	logx(4, "sock %d: wrote complete block", f->fd);
 #endif
@@ -594,13 +662,14 @@ sock_setpar(struct sock *f)
 	struct dev *d = s->opt->dev;
 	struct amsg_par *p = &f->rmsg.u.par;
 	unsigned int min, max;
-	uint32_t rate, appbufsz;
+	uint32_t rate, appbufsz, round, crate;
 	uint16_t pchan, rchan;
 
 	rchan = ntohs(p->rchan);
 	pchan = ntohs(p->pchan);
 	appbufsz = ntohl(p->appbufsz);
 	rate = ntohl(p->rate);
+	round = ntohl(p->round);
 
 	if (AMSG_ISSET(p->bits)) {
 		if (p->bits < BITS_MIN || p->bits > BITS_MAX) {
@@ -621,6 +690,7 @@ sock_setpar(struct sock *f)
 			p->bps = APARAMS_BPS(p->bits);
 		s->par.bits = p->bits;
 		s->par.bps = p->bps;
+		s->par.flt = 0;
 	}
 	if (AMSG_ISSET(p->sig))
 		s->par.sig = p->sig ? 1 : 0;
@@ -628,6 +698,28 @@ sock_setpar(struct sock *f)
 		s->par.le = p->le ? 1 : 0;
 	if (AMSG_ISSET(p->msb))
 		s->par.msb = p->msb ? 1 : 0;
+	if (AMSG_ISSET(p->flt)) {
+		s->par.flt = p->flt ? 1 : 0;
+		if (s->par.flt) {
+			s->par.bits = 32;
+			s->par.bps = 4;
+			s->par.sig = 1;
+			s->par.msb = 1;
+		}
+	}
+	if (AMSG_ISSET(p->xrun)) {
+		if (p->xrun != XRUN_IGNORE &&
+		    p->xrun != XRUN_SYNC &&
+		    p->xrun != XRUN_ERROR) {
+#ifdef DEBUG
+			logx(1, "sock %d: %u: bad xrun policy", f->fd, p->xrun);
+#endif
+			return 0;
+		}
+		s->xrun = p->xrun;
+		if (s->opt->mtc != NULL && s->xrun == XRUN_IGNORE)
+			s->xrun = XRUN_SYNC;
+	}
 	if (AMSG_ISSET(rchan) && (s->mode & MODE_RECMASK)) {
 		if (rchan < 1)
 			rchan = 1;
@@ -642,6 +734,24 @@ sock_setpar(struct sock *f)
 			pchan = NCHAN_MAX;
 		s->mix.nch = pchan;
 	}
+
+	/*
+	 * convert the requested block size to the device rate and
+	 * let the device use it, if possible. The device may be
+	 * reopened, so this is done once all parameters are checked.
+	 */
+	crate = AMSG_ISSET(rate) ? rate : s->rate;
+	if (crate < RATE_MIN)
+		crate = RATE_MIN;
+	else if (crate > RATE_MAX)
+		crate = RATE_MAX;
+	if (AMSG_ISSET(round) && round <= RATE_MAX)
+		round = ((long long)round * d->rate + crate / 2) / crate;
+	else
+		round = 0;
+	if (!dev_setround(d, s, round))
+		return 0;
+
 	if (AMSG_ISSET(rate)) {
 		if (rate < RATE_MIN)
 			rate = RATE_MIN;
@@ -652,19 +762,6 @@ sock_setpar(struct sock *f)
 		if (!AMSG_ISSET(appbufsz))
 			appbufsz = d->bufsz / d->round * s->round;
 	}
-	if (AMSG_ISSET(p->xrun)) {
-		if (p->xrun != XRUN_IGNORE &&
-		    p->xrun != XRUN_SYNC &&
-		    p->xrun != XRUN_ERROR) {
-#ifdef DEBUG
-			logx(1, "sock %d: %u: bad xrun policy", f->fd, p->xrun);
-#endif
-			return 0;
-		}
-		s->xrun = p->xrun;
-		if (s->opt->mtc != NULL && s->xrun == XRUN_IGNORE)
-			s->xrun = XRUN_SYNC;
-	}
 	if (AMSG_ISSET(appbufsz)) {
 		rate = s->rate;
 		min = 1;
@@ -711,6 +808,22 @@ sock_auth(struct sock *f)
 	return 1;
 }
 
+/*
+ * return the max size of DATA messages for version 8 clients: the
+ * largest block a client may use, i.e. the largest device block at
+ * the highest client to device rate ratio, with the max number of
+ * channels and 32-bit samples
+ */
+unsigned int
+sock_datamax(void)
+{
+	long long size;
+
+	size = (long long)dev_round * (RATE_MAX / RATE_MIN) *
+	    NCHAN_MAX * (BITS_MAX / 8);
+	return (size > AMSG_DATAMAX) ? size : AMSG_DATAMAX;
+}
+
 int
 sock_hello(struct sock *f)
 {
@@ -729,10 +842,16 @@ sock_hello(struct sock *f)
 	logx(3, "sock %d: hello from <%s>, mode %x, ver %d",
 	    f->fd, p->who, mode, p->version);
 #endif
-	if (p->version != AMSG_VERSION) {
+	if (p->version < AMSG_VERSION_MIN || p->version > AMSG_VERSION) {
 		logx(1, "sock %d: %u: unsupported version", f->fd, p->version);
 		return 0;
 	}
+
+	/*
+	 * version 7 clients can't handle DATA messages larger than
+	 * AMSG_DATAMAX, newer ones can get a full block at once
+	 */
+	f->datamax = (p->version < 8) ? AMSG_DATAMAX : sock_datamax();
 	switch (mode) {
 	case MODE_MIDIIN:
 	case MODE_MIDIOUT:
@@ -1025,6 +1144,7 @@ sock_execmsg(struct sock *f)
 		m->u.par.sig = s->par.sig;
 		m->u.par.le = s->par.le;
 		m->u.par.msb = s->par.msb;
+		m->u.par.flt = s->par.flt;
 		if (s->mode & MODE_PLAY)
 			m->u.par.pchan = htons(s->mix.nch);
 		if (s->mode & MODE_RECMASK)
@@ -1162,6 +1282,7 @@ sock_execmsg(struct sock *f)
 		}
 		AMSG_INIT(m);
 		m->cmd = htonl(AMSG_ACK);
+		m->u.ack.datamax = htonl(f->datamax);
 		f->rstate = SOCK_RRET;
 		f->rtodo = sizeof(struct amsg);
 		break;
@@ -1265,10 +1386,10 @@ sock_buildmsg(struct sock *f)
 		return 1;
 	}
 
-	if (f->midi != NULL && f->midi->obuf.used > 0) {
-		size = f->midi->obuf.used;
-		if (size > AMSG_DATAMAX)
-			size = AMSG_DATAMAX;
+	if (f->midi != NULL && abuf_used(&f->midi->obuf) > 0) {
+		size = abuf_used(&f->midi->obuf);
+		if (size > f->datamax)
+			size = f->datamax;
 		AMSG_INIT(&f->wmsg);
 		f->wmsg.cmd = htonl(AMSG_DATA);
 		f->wmsg.u.data.size = htonl(size);
@@ -1280,10 +1401,11 @@ sock_buildmsg(struct sock *f)
 	/*
 	 * If data available, build a DATA message.
 	 */
-	if (f->slot != NULL && f->wmax > 0 && f->slot->sub.buf.used > 0) {
-		size = f->slot->sub.buf.used;
-		if (size > AMSG_DATAMAX)
-			size = AMSG_DATAMAX;
+	if (f->slot != NULL && f->wmax > 0 &&
+	    abuf_used(&f->slot->sub.buf) > 0) {
+		size = abuf_used(&f->slot->sub.buf);
+		if (size > f->datamax)
+			size = f->datamax;
 		if (size > f->walign)
 			size = f->walign;
 		if (size > f->wmax)
@@ -1494,14 +1616,22 @@ sock_write(struct sock *f)
 			f->wtodo = 0xdeadbeef;
 			break;
 		}
+
+		/*
+		 * sock_wmsg() has already written the beginning of
+		 * the data block, if not all of it
+		 */
 		f->wstate = SOCK_WDATA;
-		f->wsize = f->wtodo = ntohl(f->wmsg.u.data.size);
 		/* FALLTHROUGH */
 	case SOCK_WDATA:
-		if (!sock_wdata(f))
+		if (f->wtodo > 0 && !sock_wdata(f))
 			return 0;
-		if (f->wtodo > 0)
-			break;
+		if (f->pstate != SOCK_STOP) {
+			if (f->slot)
+				slot_read(f->slot);
+			if (f->midi)
+				midi_fill(f->midi);
+		}
 		f->wstate = SOCK_WIDLE;
 		f->wtodo = 0xdeadbeef;
 		if (f->pstate == SOCK_STOP) {
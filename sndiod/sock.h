@@ -34,6 +34,7 @@ struct sock {
 	unsigned int wsize;		/* output bytes to write (DATA msg) */
 	unsigned int rtodo;		/* input bytes not read yet */
 	unsigned int wtodo;		/* output bytes not written yet */
+	unsigned int datamax;		/* max size of DATA messages */
 #define SOCK_RIDLE	0		/* not expecting messages */
 #define SOCK_RMSG	1		/* expecting a message */
 #define SOCK_RDATA	2		/* data chunk being read */
@@ -21,12 +21,16 @@
  * slow syscalls are no longer disruptive, e.g. at the end of the poll() loop.
  */
 #include <errno.h>
+#ifdef USE_THREADS
+#include <pthread.h>
+#endif
 #include <signal.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <syslog.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include "utils.h"
@@ -39,17 +43,64 @@
 char log_buf[LOG_BUFSZ];	/* buffer where traces are stored */
 size_t log_used = 0;		/* bytes used in the buffer */
 unsigned int log_sync = 1;	/* if true, flush after each '\n' */
+unsigned int log_syslog = 0;	/* if true, flush to syslog(3) */
+#ifdef USE_THREADS
+pthread_mutex_t log_mtx = PTHREAD_MUTEX_INITIALIZER;	/* device threads */
+#endif
 
 /*
- * write the log buffer on stderr
+ * Audio buffers are allocated with xbuf_get(). Once released, they are
+ * kept on the free list of their size class, for reuse, as long as the
+ * total size of free buffers doesn't exceed xbuf_max. Classes are powers
+ * of two, larger buffers are not kept.
+ */
+#define XBUF_MINSHIFT	6		/* smallest class is 64 bytes */
+#define XBUF_NCLASS	20		/* largest class is 32MB */
+
+struct xbuf {
+	union {
+		struct xbuf *next;	/* next free buffer of the class */
+		unsigned int cls;	/* size class, if in use */
+		char pad[16];		/* keep data aligned */
+	} u;
+};
+
+struct xbuf *xbuf_free[XBUF_NCLASS];
+size_t xbuf_max = 1024 * 1024;	/* max bytes on free lists */
+size_t xbuf_cached;		/* bytes on free lists */
+unsigned int xbuf_nalloc;	/* buffers allocated */
+unsigned int xbuf_nreuse;	/* buffers taken from free lists */
+#ifdef USE_THREADS
+pthread_mutex_t xbuf_mtx = PTHREAD_MUTEX_INITIALIZER;	/* device threads */
+#endif
+
+/*
+ * write the log buffer on stderr, or to syslog(3) once stderr is gone
  */
 void
 log_flush(void)
 {
-	if (log_used == 0)
-		return;
-	write(STDERR_FILENO, log_buf, log_used);
-	log_used = 0;
+	char *p, *q, *end;
+
+#ifdef USE_THREADS
+	pthread_mutex_lock(&log_mtx);
+#endif
+	if (log_used > 0) {
+		if (log_syslog) {
+			end = log_buf + log_used;
+			for (p = log_buf; p < end; p = q + 1) {
+				q = memchr(p, '\n', end - p);
+				if (q == NULL)
+					q = end;
+				syslog(LOG_INFO, "%.*s", (int)(q - p), p);
+			}
+		} else
+			write(STDERR_FILENO, log_buf, log_used);
+		log_used = 0;
+	}
+#ifdef USE_THREADS
+	pthread_mutex_unlock(&log_mtx);
+#endif
 }
 
 /*
@@ -61,6 +112,9 @@ log_do(const char *fmt, ...)
 	va_list ap;
 	int n, save_errno = errno;
 
+#ifdef USE_THREADS
+	pthread_mutex_lock(&log_mtx);
+#endif
 	va_start(ap, fmt);
 	n = vsnprintf(log_buf + log_used, sizeof(log_buf) - log_used, fmt, ap);
 	va_end(ap);
@@ -71,10 +125,12 @@ log_do(const char *fmt, ...)
 		if (log_used >= sizeof(log_buf))
 			log_used = sizeof(log_buf) - 1;
 		log_buf[log_used++] = '\n';
-
-		if (log_sync)
-			log_flush();
 	}
+#ifdef USE_THREADS
+	pthread_mutex_unlock(&log_mtx);
+#endif
+	if (n != -1 && log_sync)
+		log_flush();
 	errno = save_errno;
 }
 
@@ -122,6 +178,98 @@ xfree(void *p)
 	free(p);
 }
 
+/*
+ * allocate a buffer of at least 'size' bytes, reusing a free one if
+ * possible
+ */
+void *
+xbuf_get(size_t size)
+{
+	struct xbuf *b;
+	unsigned int cls;
+
+	for (cls = 0; cls < XBUF_NCLASS; cls++) {
+		if (size <= (size_t)1 << (cls + XBUF_MINSHIFT))
+			break;
+	}
+#ifdef USE_THREADS
+	pthread_mutex_lock(&xbuf_mtx);
+#endif
+	b = (cls < XBUF_NCLASS) ? xbuf_free[cls] : NULL;
+	if (b != NULL) {
+		xbuf_free[cls] = b->u.next;
+		xbuf_cached -= (size_t)1 << (cls + XBUF_MINSHIFT);
+		xbuf_nreuse++;
+	} else
+		xbuf_nalloc++;
+#ifdef USE_THREADS
+	pthread_mutex_unlock(&xbuf_mtx);
+#endif
+	if (b == NULL) {
+		b = xmalloc(sizeof(struct xbuf) + ((cls < XBUF_NCLASS) ?
+		    (size_t)1 << (cls + XBUF_MINSHIFT) : size));
+	}
+	b->u.cls = cls;
+	return b + 1;
+}
+
+/*
+ * release a buffer allocated with xbuf_get()
+ */
+void
+xbuf_put(void *p)
+{
+	struct xbuf *b;
+	unsigned int cls;
+	size_t size;
+
+#ifdef DEBUG
+	if (p == NULL) {
+		logx(0, "xbuf_put with NULL arg");
+		panic();
+	}
+#endif
+	b = (struct xbuf *)p - 1;
+	cls = b->u.cls;
+	if (cls < XBUF_NCLASS) {
+		size = (size_t)1 << (cls + XBUF_MINSHIFT);
+#ifdef USE_THREADS
+		pthread_mutex_lock(&xbuf_mtx);
+#endif
+		if (xbuf_cached + size <= xbuf_max) {
+			b->u.next = xbuf_free[cls];
+			xbuf_free[cls] = b;
+			xbuf_cached += size;
+			b = NULL;
+		}
+#ifdef USE_THREADS
+		pthread_mutex_unlock(&xbuf_mtx);
+#endif
+	}
+	if (b != NULL)
+		xfree(b);
+}
+
+/*
+ * free buffers on the free lists and log statistics
+ */
+void
+xbuf_done(void)
+{
+	struct xbuf *b;
+	unsigned int cls;
+
+	logx(2, "buffers: %u allocated, %u reused, %zu bytes kept",
+	    xbuf_nalloc, xbuf_nreuse, xbuf_cached);
+	for (cls = 0; cls < XBUF_NCLASS; cls++) {
+		while ((b = xbuf_free[cls]) != NULL) {
+			xbuf_free[cls] = b->u.next;
+			xfree(b);
+		}
+	}
+	xbuf_cached = 0;
+}
+
 /*
  * xmalloc-style strdup(3)
  */
@@ -33,6 +33,9 @@ void log_do(const char *, ...) __attribute__((__format__ (printf, 1, 2)));
 void *xmalloc(size_t);
 char *xstrdup(char *);
 void xfree(void *);
+void *xbuf_get(size_t);
+void xbuf_put(void *);
+void xbuf_done(void);
 
 /*
  * Log levels:
@@ -45,5 +48,7 @@ void xfree(void *);
  */
 extern unsigned int log_level;
 extern unsigned int log_sync;
+extern unsigned int log_syslog;
+extern size_t xbuf_max;
 
 #endif
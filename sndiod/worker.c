@@ -0,0 +1,198 @@
+/*	$OpenBSD$	*/
+/*
+ * Copyright (c) 2026 Alexandre Ratchov <alex@caoua.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+/*
+ * Pool of threads running the jobs of a processing cycle in parallel.
+ *
+ * The caller of worker_run() processes jobs as well, with worker
+ * number 0, and returns once all of them are done; jobs are picked
+ * in order, but may complete in any order, so they must be
+ * independent of each other. Cycles of different devices are
+ * serialized.
+ */
+#ifdef USE_THREADS
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <string.h>
+#include "utils.h"
+#include "worker.h"
+
+void *worker_main(void *);
+void worker_loop(int);
+
+unsigned int worker_count;
+
+pthread_t worker_thread[WORKER_NMAX];
+int worker_id[WORKER_NMAX];
+pthread_mutex_t worker_mtx = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t worker_runmtx = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t worker_start = PTHREAD_COND_INITIALIZER;
+pthread_cond_t worker_finish = PTHREAD_COND_INITIALIZER;
+
+/*
+ * state of the current cycle, protected by worker_mtx
+ */
+void (*worker_func)(void *, int, int);
+void *worker_arg;
+int worker_njobs;			/* number of jobs in the cycle */
+int worker_next;			/* next job to pick */
+int worker_ndone;			/* jobs completed */
+int worker_nwake;			/* workers to wake up */
+int worker_quit;
+
+/*
+ * run jobs of the current cycle until there are none left, must be
+ * called with worker_mtx held
+ */
+void
+worker_loop(int id)
+{
+	void (*func)(void *, int, int);
+	void *arg;
+	int job;
+
+	while (worker_next < worker_njobs) {
+		job = worker_next++;
+		func = worker_func;
+		arg = worker_arg;
+		pthread_mutex_unlock(&worker_mtx);
+		func(arg, job, id);
+		pthread_mutex_lock(&worker_mtx);
+		if (++worker_ndone == worker_njobs)
+			pthread_cond_signal(&worker_finish);
+	}
+}
+
+void *
+worker_main(void *arg)
+{
+	int id = *(int *)arg;
+
+	pthread_mutex_lock(&worker_mtx);
+	for (;;) {
+		while (worker_nwake == 0 && !worker_quit)
+			pthread_cond_wait(&worker_start, &worker_mtx);
+		if (worker_quit)
+			break;
+		worker_nwake--;
+		worker_loop(id);
+	}
+	pthread_mutex_unlock(&worker_mtx);
+	return NULL;
+}
+
+/*
+ * start the given number of worker threads, with the given real-time
+ * priority or the lowest one if 0
+ */
+int
+worker_init(unsigned int n, int prio)
+{
+	struct sched_param sp;
+	sigset_t set, oset;
+	int err;
+
+	if (n > WORKER_NMAX)
+		n = WORKER_NMAX;
+
+	/*
+	 * signals are handled by the main loop only
+	 */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &oset);
+	for (worker_count = 0; worker_count < n; worker_count++) {
+		worker_id[worker_count] = worker_count + 1;
+		err = pthread_create(&worker_thread[worker_count], NULL,
+		    worker_main, &worker_id[worker_count]);
+		if (err != 0) {
+			logx(1, "failed to create worker thread");
+			break;
+		}
+		sp.sched_priority = (prio > 0) ?
+		    prio : sched_get_priority_min(SCHED_FIFO);
+		err = pthread_setschedparam(worker_thread[worker_count],
+		    SCHED_FIFO, &sp);
+		if (err != 0 && worker_count == 0) {
+			logx(prio > 0 ? 0 : 2,
+			    "workers couldn't use real-time scheduling");
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &oset, NULL);
+	logx(3, "%u worker threads started", worker_count);
+	return worker_count == n;
+}
+
+/*
+ * stop all worker threads
+ */
+void
+worker_done(void)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&worker_mtx);
+	worker_quit = 1;
+	pthread_cond_broadcast(&worker_start);
+	pthread_mutex_unlock(&worker_mtx);
+	for (i = 0; i < worker_count; i++)
+		pthread_join(worker_thread[i], NULL);
+	worker_count = 0;
+	worker_quit = 0;
+}
+
+/*
+ * run the given number of jobs, as func(arg, job, worker), and
+ * return once all of them are done. The caller runs jobs as well,
+ * so at most njobs - 1 workers are woken up, and we don't wait for
+ * the ones that find no job left
+ */
+void
+worker_run(int njobs, void (*func)(void *, int, int), void *arg)
+{
+	int i, job;
+
+	/*
+	 * waking up threads costs more than a single job
+	 */
+	if (worker_count == 0 || njobs <= 1) {
+		for (job = 0; job < njobs; job++)
+			func(arg, job, 0);
+		return;
+	}
+
+	pthread_mutex_lock(&worker_runmtx);
+	pthread_mutex_lock(&worker_mtx);
+	worker_func = func;
+	worker_arg = arg;
+	worker_njobs = njobs;
+	worker_next = 0;
+	worker_ndone = 0;
+	worker_nwake = (njobs - 1 < worker_count) ? njobs - 1 : worker_count;
+	for (i = 0; i < worker_nwake; i++)
+		pthread_cond_signal(&worker_start);
+	worker_loop(0);
+	while (worker_ndone < worker_njobs)
+		pthread_cond_wait(&worker_finish, &worker_mtx);
+
+	/*
+	 * workers not woken up yet have nothing left to do
+	 */
+	worker_nwake = 0;
+	pthread_mutex_unlock(&worker_mtx);
+	pthread_mutex_unlock(&worker_runmtx);
+}
+#endif /* defined USE_THREADS */